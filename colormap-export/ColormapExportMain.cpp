@@ -1,5 +1,5 @@
 #include <LoadPalette.h>
-#include <PaletteImage.h>
+#include <PaletteLookup.h>
 
 #include <molecular/util/CommandLineParser.h>
 #include <molecular/util/FileStreamStorage.h>
@@ -8,9 +8,10 @@
 
 using namespace molecular::util;
 
-std::vector<uint8_t> GenerateColormap(const uint8_t palette[768])
+std::vector<uint8_t> GenerateColormap(const uint8_t palette[768], ColorMetric metric)
 {
 	std::vector<uint8_t> colormap(16384);
+	const PaletteLookup lookup(palette, 224, metric);
 	for(int x = 0; x < 256; x++)
 	{
 		for(int y = 0; y < 64; y++)
@@ -26,7 +27,7 @@ std::vector<uint8_t> GenerateColormap(const uint8_t palette[768])
 				for (int i = 0; i < 3; i++)
 					rgb[i] = std::min((palette[x * 3 + i] * (63 - y) + 16) >> 5, 256);
 
-				colormap[y * 256 + x] = FindClosestPaletteColor(rgb, palette, 224);
+				colormap[y * 256 + x] = lookup.FindClosest(rgb);
 			}
 		}
 	}
@@ -38,6 +39,7 @@ int Main(int argc, char** argv)
 	CommandLineParser cmd;
 	CommandLineParser::PositionalArg<std::string> inFileName(cmd, "input file", "Input palette file");
 	CommandLineParser::PositionalArg<std::string> outFileName(cmd, "output file", "Output colormap file");
+	CommandLineParser::Option<std::string> metric(cmd, "metric", "Color distance for palette matching: rgb or oklab", "rgb");
 	CommandLineParser::HelpFlag help(cmd);
 
 	try
@@ -52,7 +54,7 @@ int Main(int argc, char** argv)
 	}
 
 	auto palette = LoadPaletteFile(inFileName->c_str());
-	auto colormap = GenerateColormap(palette.data());
+	auto colormap = GenerateColormap(palette.data(), ParseColorMetric(*metric));
 
 	FileWriteStorage outFile(outFileName->c_str());
 	outFile.Write(colormap.data(), 16384);
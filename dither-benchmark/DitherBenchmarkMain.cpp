@@ -0,0 +1,114 @@
+#include <ErrorDiffusion.h>
+#include <PaletteLookup.h>
+#include <QuakePalette.h>
+
+#include <molecular/util/CommandLineParser.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+using namespace molecular::util;
+
+/// Smooth gradients with some noise on top, the same on every run
+static std::vector<uint8_t> MakeTestImage(int width, int height)
+{
+	std::vector<uint8_t> image(static_cast<size_t>(width) * height * 4);
+	uint32_t random = 12345;
+	for(int y = 0; y < height; ++y)
+	{
+		for(int x = 0; x < width; ++x)
+		{
+			uint8_t* pixel = &image[(static_cast<size_t>(y) * width + x) * 4];
+			random = random * 1664525 + 1013904223;
+			const int noise = static_cast<int>(random >> 28) - 8;
+			pixel[0] = static_cast<uint8_t>(std::clamp(x * 255 / width + noise, 0, 255));
+			pixel[1] = static_cast<uint8_t>(std::clamp(y * 255 / height + noise, 0, 255));
+			pixel[2] = static_cast<uint8_t>(std::clamp((x + y) * 255 / (width + height) - noise, 0, 255));
+			pixel[3] = 255;
+		}
+	}
+	return image;
+}
+
+int Main(int argc, char** argv)
+{
+	CommandLineParser cmd;
+	CommandLineParser::Option<int> size(cmd, "size", "Width and height of the test image", 1024);
+	CommandLineParser::Option<int> runs(cmd, "runs", "Runs per configuration, the fastest one is reported", 5);
+	CommandLineParser::Option<int> threads(cmd, "threads", "Number of threads, 0 uses all hardware threads. Serpentine scans always run on one.", 1);
+
+	CommandLineParser::HelpFlag help(cmd);
+
+	try
+	{
+		cmd.Parse(argc, argv);
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		cmd.PrintHelp();
+		return EXIT_FAILURE;
+	}
+
+	if(*size <= 0 || *runs <= 0)
+		throw std::runtime_error("Size and runs must be positive");
+
+	const int width = *size;
+	const int height = *size;
+	const std::vector<uint8_t> image = MakeTestImage(width, height);
+	const PaletteLookup lookup(quakePalette, 256);
+	std::vector<uint8_t> indices(image.size() / 4);
+
+	const struct {DiffusionKernel kernel; const char* name;} kernels[] = {
+		{DiffusionKernel::FLOYD_STEINBERG, "floyd-steinberg"},
+		{DiffusionKernel::ATKINSON, "atkinson"},
+		{DiffusionKernel::SIERRA, "sierra"},
+		{DiffusionKernel::JARVIS_JUDICE_NINKE, "jarvis"}
+	};
+	const struct {DiffusionPrecision precision; const char* name;} precisions[] = {
+		{DiffusionPrecision::REFERENCE, "reference"},
+		{DiffusionPrecision::ACCUMULATE, "accumulate"}
+	};
+
+	std::printf("%dx%d pixels, best of %d runs\n", width, height, *runs);
+	std::printf("%-16s %-11s %-11s %10s %10s\n", "kernel", "precision", "scan", "ms", "Mpixel/s");
+	for(const auto& kernel: kernels)
+	{
+		for(const auto& precision: precisions)
+		{
+			for(bool serpentine: {false, true})
+			{
+				double best = 0;
+				for(int run = 0; run < *runs; ++run)
+				{
+					const auto start = std::chrono::steady_clock::now();
+					DiffuseError(image.data(), width, height, 4, lookup, kernel.kernel, serpentine, precision.precision, indices.data(), *threads);
+					const std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+					if(run == 0 || time.count() < best)
+						best = time.count();
+				}
+				std::printf("%-16s %-11s %-11s %10.2f %10.1f\n", kernel.name, precision.name, serpentine ? "serpentine" : "raster", best,
+							static_cast<double>(width) * height / best / 1000);
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		return Main(argc, argv);
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,81 @@
+#include "BufferPool.h"
+
+#include <algorithm>
+
+/// Smallest class whose buffers all hold at least size elements
+static int ClassForSize(size_t size)
+{
+	int sizeClass = 0;
+	while((size_t(1) << sizeClass) < size)
+		++sizeClass;
+	return sizeClass;
+}
+
+/// Class of a buffer with the given capacity
+static int ClassForCapacity(size_t capacity)
+{
+	int sizeClass = 0;
+	while((capacity >> (sizeClass + 1)) != 0)
+		++sizeClass;
+	return sizeClass;
+}
+
+template<class T>
+std::vector<T> BufferPool::Acquire(Classes<T>& classes, size_t size)
+{
+	const int sizeClass = ClassForSize(size);
+	{
+		// Buffers of up to four times the size are fine to reuse:
+		std::lock_guard<std::mutex> lock(mMutex);
+		for(int i = sizeClass; i < std::min(sizeClass + 3, kNumClasses); ++i)
+		{
+			if(!classes[i].empty())
+			{
+				std::vector<T> buffer = std::move(classes[i].back());
+				classes[i].pop_back();
+				buffer.resize(size);
+				return buffer;
+			}
+		}
+	}
+
+	++mNumAllocations;
+	std::vector<T> buffer;
+	buffer.reserve(size_t(1) << sizeClass);
+	buffer.resize(size);
+	return buffer;
+}
+
+template<class T>
+void BufferPool::Release(Classes<T>& classes, std::vector<T>&& buffer)
+{
+	if(buffer.capacity() == 0)
+		return;
+	const int sizeClass = ClassForCapacity(buffer.capacity());
+	if(sizeClass >= kNumClasses)
+		return;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	if(classes[sizeClass].size() < kMaxPerClass)
+		classes[sizeClass].push_back(std::move(buffer));
+}
+
+std::vector<uint8_t> BufferPool::AcquireBytes(size_t size)
+{
+	return Acquire(mBytes, size);
+}
+
+std::vector<float> BufferPool::AcquireFloats(size_t size)
+{
+	return Acquire(mFloats, size);
+}
+
+void BufferPool::Release(std::vector<uint8_t>&& buffer)
+{
+	Release(mBytes, std::move(buffer));
+}
+
+void BufferPool::Release(std::vector<float>&& buffer)
+{
+	Release(mFloats, std::move(buffer));
+}
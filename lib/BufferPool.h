@@ -0,0 +1,51 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/// Recycles image buffers between conversions
+/** Batch jobs convert many textures of the same few sizes. Buffers released to the pool are kept in size classes
+	of powers of two and handed out again for requests of a similar size, so that after the first few textures
+	no more image memory is allocated. New buffers get a power of two capacity for the same reason.
+	Thread-safe. */
+class BufferPool
+{
+public:
+	/// Buffer with size elements and undefined contents
+	std::vector<uint8_t> AcquireBytes(size_t size);
+	std::vector<float> AcquireFloats(size_t size);
+
+	/// Give a buffer back for reuse
+	void Release(std::vector<uint8_t>&& buffer);
+	void Release(std::vector<float>&& buffer);
+
+	/// Number of buffers that had to be allocated because none could be reused
+	/** Stops growing once a batch of same-sized conversions reaches its steady state. */
+	size_t GetNumAllocations() const {return mNumAllocations;}
+
+private:
+	static constexpr int kNumClasses = 48;
+
+	/// Buffers kept per size class. Any more are freed.
+	static constexpr size_t kMaxPerClass = 16;
+
+	template<class T>
+	using Classes = std::vector<std::vector<T>>[kNumClasses];
+
+	template<class T>
+	std::vector<T> Acquire(Classes<T>& classes, size_t size);
+
+	template<class T>
+	void Release(Classes<T>& classes, std::vector<T>&& buffer);
+
+	std::mutex mMutex;
+	Classes<uint8_t> mBytes;
+	Classes<float> mFloats;
+	std::atomic<size_t> mNumAllocations{0};
+};
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,86 @@
+#include "ColorCache.h"
+#include "PaletteKernel.h"
+#include "PaletteLookup.h"
+
+ColorCache::ColorCache(size_t maxColors) :
+	mMaxColors(maxColors)
+{
+	// At most half full, so probe sequences stay short:
+	int bits = 4;
+	while((size_t(1) << bits) < 2 * maxColors)
+		++bits;
+	mMask = (size_t(1) << bits) - 1;
+	mShift = 32 - bits;
+	mKeys.resize(mMask + 1, 0);
+	mIndices.resize(mMask + 1, 0);
+}
+
+bool ColorCache::Collect(const uint8_t* pixels, size_t pixelStride, size_t count)
+{
+	// Runs of equal colors are common in this kind of image:
+	uint32_t previous = 0;
+	for(size_t i = 0; i < count; ++i, pixels += pixelStride)
+	{
+		const uint32_t key = Key(pixels);
+		if(key == previous)
+			continue;
+		previous = key;
+
+		size_t slot = Hash(key);
+		while(mKeys[slot] != key && mKeys[slot] != 0)
+			slot = (slot + 1) & mMask;
+		if(mKeys[slot] == 0)
+		{
+			if(mSize == mMaxColors)
+				return false;
+			mKeys[slot] = key;
+			mPending.push_back(slot);
+			++mSize;
+		}
+	}
+	return true;
+}
+
+std::vector<uint8_t> ColorCache::PendingColors() const
+{
+	std::vector<uint8_t> colors;
+	colors.reserve(mPending.size() * 3);
+	for(uint32_t slot: mPending)
+	{
+		const uint32_t key = mKeys[slot];
+		colors.push_back(key >> 16);
+		colors.push_back(key >> 8);
+		colors.push_back(key);
+	}
+	return colors;
+}
+
+void ColorCache::Resolve(const PaletteLookup& lookup)
+{
+	const std::vector<uint8_t> colors = PendingColors();
+	std::vector<uint8_t> indices(mPending.size());
+	lookup.FindClosest(colors.data(), 3, indices.size(), indices.data());
+	for(size_t i = 0; i < indices.size(); ++i)
+		mIndices[mPending[i]] = indices[i];
+	mPending.clear();
+}
+
+void ColorCache::Resolve(const PaletteKernel& kernel)
+{
+	const std::vector<uint8_t> colors = PendingColors();
+	std::vector<uint8_t> indices(mPending.size());
+	kernel.FindClosest(colors.data(), 3, indices.size(), indices.data());
+	for(size_t i = 0; i < indices.size(); ++i)
+		mIndices[mPending[i]] = indices[i];
+	mPending.clear();
+}
+
+size_t ColorCache::Get(const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices) const
+{
+	for(size_t i = 0; i < count; ++i, pixels += pixelStride)
+	{
+		if(!Get(pixels, indices[i]))
+			return i;
+	}
+	return count;
+}
@@ -0,0 +1,81 @@
+#ifndef COLORCACHE_H
+#define COLORCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class PaletteKernel;
+class PaletteLookup;
+
+/// Palette indices of exact RGB colors, for images with few unique colors
+/** An open-addressing hash table with linear probing from packed RGB to palette index. Pixel art, HUD and menu
+	graphics often use only a few hundred colors, so searching the palette once per color instead of once per
+	pixel saves most of the work.
+
+	Collect() the colors of an image first, then Resolve() them against the palette and Get() the indices. A cache
+	can be shared by many images, as long as they are all resolved against the same palette. */
+class ColorCache
+{
+public:
+	/// @param maxColors Collect() gives up when there are more colors than this.
+	explicit ColorCache(size_t maxColors = 4096);
+
+	/// Add all colors of an image
+	/** Cheap enough to run as a pre-pass: Returns false as soon as the cache would exceed maxColors, which for
+		photographic images happens after a few thousand pixels. Colors added up to then remain in the cache.
+		@param pixelStride Distance between pixels in bytes, e.g. 3 for RGB or 4 for RGBA. */
+	bool Collect(const uint8_t* pixels, size_t pixelStride, size_t count);
+
+	/// Find palette indices for all colors added since the last call
+	void Resolve(const PaletteLookup& lookup);
+	void Resolve(const PaletteKernel& kernel);
+
+	/// Palette index of a collected and resolved color
+	/** @return false if the color was never collected, e.g. because Collect() gave up before it. */
+	bool Get(const uint8_t rgb[3], uint8_t& index) const
+	{
+		// The table is never more than half full, so every probe sequence ends at an empty slot:
+		const uint32_t key = Key(rgb);
+		for(size_t slot = Hash(key); mKeys[slot] != 0; slot = (slot + 1) & mMask)
+		{
+			if(mKeys[slot] == key)
+			{
+				index = mIndices[slot];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/// Palette indices for many collected and resolved pixels at once
+	/** @return Number of pixels done. Stops at the first color that is not in the cache, look that and the
+		remaining pixels up elsewhere. */
+	size_t Get(const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices) const;
+
+	size_t GetSize() const {return mSize;}
+
+private:
+	/// Marks occupied slots, so black is not mistaken for an empty slot
+	static constexpr uint32_t kOccupied = 1u << 24;
+
+	static uint32_t Key(const uint8_t rgb[3]) {return kOccupied | (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];}
+
+	/// Fibonacci hashing
+	size_t Hash(uint32_t key) const {return (key * 2654435769u) >> mShift;}
+
+	/// Packed colors that have no index yet, as RGB triplets
+	std::vector<uint8_t> PendingColors() const;
+
+	const size_t mMaxColors;
+	size_t mMask;
+	int mShift;
+	size_t mSize = 0;
+	std::vector<uint32_t> mKeys;
+	std::vector<uint8_t> mIndices;
+
+	/// Slots added since the last Resolve()
+	std::vector<uint32_t> mPending;
+};
+
+#endif // COLORCACHE_H
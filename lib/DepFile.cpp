@@ -0,0 +1,31 @@
+#include "DepFile.h"
+
+#include <fstream>
+#include <stdexcept>
+
+static std::string Escape(const std::string& fileName)
+{
+	std::string escaped;
+	for(char c: fileName)
+	{
+		if(c == ' ' || c == '#')
+			escaped += '\\';
+		else if(c == '$')
+			escaped += '$';
+		escaped += c;
+	}
+	return escaped;
+}
+
+void WriteDepFile(const std::string& depFileName, const std::vector<std::string>& targets, const std::vector<std::string>& inputs)
+{
+	std::ofstream file(depFileName);
+	for(size_t i = 0; i < targets.size(); ++i)
+		file << (i > 0 ? " " : "") << Escape(targets[i]);
+	file << ":";
+	for(const std::string& input: inputs)
+		file << " \\\n  " << Escape(input);
+	file << "\n";
+	if(!file)
+		throw std::runtime_error("Could not write " + depFileName);
+}
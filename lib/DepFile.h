@@ -0,0 +1,12 @@
+#ifndef DEPFILE_H
+#define DEPFILE_H
+
+#include <string>
+#include <vector>
+
+/// Write a Makefile rule listing the inputs of the given targets
+/** Make and Ninja read these to find inputs they can't see in the build script, like the OBJ and image files
+	named in an MDL JSON file. Spaces, '#' and '$' in file names are escaped. */
+void WriteDepFile(const std::string& depFileName, const std::vector<std::string>& targets, const std::vector<std::string>& inputs);
+
+#endif // DEPFILE_H
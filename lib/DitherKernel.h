@@ -0,0 +1,118 @@
+#ifndef DITHERKERNEL_H
+#define DITHERKERNEL_H
+
+#include <algorithm>
+#include <cstdint>
+
+/// One tap of an error diffusion kernel
+/** @tparam Dx Horizontal offset in scan direction. Negated on right-to-left rows.
+	@tparam Dy Vertical offset, 0 for the current row.
+	@tparam Weight Share of the error, in units of the kernel divisor. */
+template<int Dx, int Dy, int Weight>
+struct DitherTap
+{
+	static constexpr int dx = Dx;
+	static constexpr int dy = Dy;
+	static constexpr int weight = Weight;
+};
+
+/// Error diffusion kernel with compile time taps
+/** Taps are expanded with fold expressions, so the whole error spread unrolls into straight-line code with
+	constant offsets. Pixel state is stored as three int32 per pixel, in rows padded by kRadius pixels on both
+	sides, so no tap needs a bounds check. */
+template<int Divisor, class... Taps>
+class DitherKernel
+{
+	static constexpr int Abs(int value) {return value < 0 ? -value : value;}
+
+public:
+	static constexpr int kDivisor = Divisor;
+
+	/// Number of rows touched, including the current one
+	static constexpr int kRows = std::max({Taps::dy...}) + 1;
+
+	/// Largest horizontal tap distance
+	static constexpr int kRadius = std::max({Abs(Taps::dx)...});
+
+	/// Spread error with per tap truncation and clamping
+	/** @param rows State of the current row and the kRows - 1 rows below, pointing at the first unpadded pixel.
+		@param Step 1 for left-to-right rows, -1 for right-to-left rows. */
+	template<int Step>
+	static void SpreadClamped(int32_t* const rows[], int x, const int32_t error[3])
+	{
+		(SpreadClampedTap<Step, Taps>(rows, x, error), ...);
+	}
+
+	/// Sum up error terms in 1/kDivisor units
+	template<int Step>
+	static void SpreadSum(int32_t* const rows[], int x, const int32_t error[3])
+	{
+		(SpreadSumTap<Step, Taps>(rows, x, error), ...);
+	}
+
+	/// Spread error in floats, with four lanes per pixel
+	/** The fourth lane is padding, so every tap is a single four-wide vector operation. */
+	template<int Step>
+	static void SpreadFloat(float* const rows[], int x, const float error[4])
+	{
+		(SpreadFloatTap<Step, Taps>(rows, x, error), ...);
+	}
+
+	/// Error sum in 1/kDivisor units to pixel units, rounded half up
+	static int32_t Round(int32_t sum)
+	{
+		sum += kDivisor / 2;
+		return sum >= 0 ? sum / kDivisor : (sum - (kDivisor - 1)) / kDivisor;
+	}
+
+private:
+	template<int Step, class Tap>
+	static void SpreadClampedTap(int32_t* const rows[], int x, const int32_t error[3])
+	{
+		int32_t* target = rows[Tap::dy] + (x + Tap::dx * Step) * 3;
+		for(int c = 0; c < 3; ++c)
+			target[c] = std::min(std::max(target[c] + error[c] * Tap::weight / kDivisor, 0), 255);
+	}
+
+	template<int Step, class Tap>
+	static void SpreadSumTap(int32_t* const rows[], int x, const int32_t error[3])
+	{
+		int32_t* target = rows[Tap::dy] + (x + Tap::dx * Step) * 3;
+		for(int c = 0; c < 3; ++c)
+			target[c] += error[c] * Tap::weight;
+	}
+
+	template<int Step, class Tap>
+	static void SpreadFloatTap(float* const rows[], int x, const float error[4])
+	{
+		constexpr float weight = float(Tap::weight) / kDivisor;
+		float* target = rows[Tap::dy] + (x + Tap::dx * Step) * 4;
+		for(int c = 0; c < 4; ++c)
+			target[c] += error[c] * weight;
+	}
+};
+
+/// Floyd–Steinberg (1976)
+using FloydSteinbergKernel = DitherKernel<16,
+	DitherTap<1, 0, 7>,
+	DitherTap<-1, 1, 3>, DitherTap<0, 1, 5>, DitherTap<1, 1, 1>>;
+
+/// Atkinson, as used on the original Macintosh. Only spreads 3/4 of the error, which gives more contrast.
+using AtkinsonKernel = DitherKernel<8,
+	DitherTap<1, 0, 1>, DitherTap<2, 0, 1>,
+	DitherTap<-1, 1, 1>, DitherTap<0, 1, 1>, DitherTap<1, 1, 1>,
+	DitherTap<0, 2, 1>>;
+
+/// Sierra (1989), three rows
+using SierraKernel = DitherKernel<32,
+	DitherTap<1, 0, 5>, DitherTap<2, 0, 3>,
+	DitherTap<-2, 1, 2>, DitherTap<-1, 1, 4>, DitherTap<0, 1, 5>, DitherTap<1, 1, 4>, DitherTap<2, 1, 2>,
+	DitherTap<-1, 2, 2>, DitherTap<0, 2, 3>, DitherTap<1, 2, 2>>;
+
+/// Jarvis, Judice and Ninke (1976)
+using JarvisKernel = DitherKernel<48,
+	DitherTap<1, 0, 7>, DitherTap<2, 0, 5>,
+	DitherTap<-2, 1, 3>, DitherTap<-1, 1, 5>, DitherTap<0, 1, 7>, DitherTap<1, 1, 5>, DitherTap<2, 1, 3>,
+	DitherTap<-2, 2, 1>, DitherTap<-1, 2, 3>, DitherTap<0, 2, 5>, DitherTap<1, 2, 3>, DitherTap<2, 2, 1>>;
+
+#endif // DITHERKERNEL_H
@@ -0,0 +1,237 @@
+#include "ErrorDiffusion.h"
+#include "PaletteLookup.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+/// Number of pixels between progress updates in the wavefront
+static constexpr int kWavefrontChunk = 32;
+
+static inline int32_t Clamp(int32_t value)
+{
+	return std::min(std::max(value, 0), 255);
+}
+
+/// Values per padded state row
+template<class Kernel>
+static size_t StateSize(int width)
+{
+	return static_cast<size_t>(width + 2 * Kernel::kRadius) * 3;
+}
+
+/// Copy source row into REFERENCE state
+static void LoadRow(const uint8_t* row, int width, int channels, int32_t* state)
+{
+	for(int x = 0; x < width; ++x)
+		for(int c = 0; c < 3; ++c)
+			state[x * 3 + c] = row[x * channels + c];
+}
+
+/// Quantize pixels [begin, end) of a row in REFERENCE precision
+/** @param rows State of this row and the rows below, see DitherKernel. */
+template<class Kernel, int Step>
+static void DiffuseReference(const PaletteLookup& lookup, int32_t* const rows[], int begin, int end, uint8_t* indices)
+{
+	for(int i = begin; i < end; ++i)
+	{
+		const int x = Step > 0 ? i : begin + end - 1 - i;
+		const int32_t* pixel = rows[0] + x * 3;
+		const uint8_t index = lookup.FindClosest(pixel[0], pixel[1], pixel[2]);
+		indices[x] = index;
+		const uint8_t* color = lookup.GetColor(index);
+
+		const int32_t error[3] = {pixel[0] - color[0], pixel[1] - color[1], pixel[2] - color[2]};
+		Kernel::template SpreadClamped<Step>(rows, x, error);
+	}
+}
+
+/// Quantize pixels [begin, end) of a row in ACCUMULATE precision
+template<class Kernel, int Step>
+static void DiffuseAccumulate(const PaletteLookup& lookup, const uint8_t* row, int channels, int32_t* const rows[], int begin, int end, uint8_t* indices)
+{
+	for(int i = begin; i < end; ++i)
+	{
+		const int x = Step > 0 ? i : begin + end - 1 - i;
+		const uint8_t* source = row + x * channels;
+		const int32_t* sum = rows[0] + x * 3;
+		int32_t pixel[3];
+		for(int c = 0; c < 3; ++c)
+			pixel[c] = Clamp(source[c] + Kernel::Round(sum[c]));
+
+		const uint8_t index = lookup.FindClosest(pixel[0], pixel[1], pixel[2]);
+		indices[x] = index;
+		const uint8_t* color = lookup.GetColor(index);
+
+		const int32_t error[3] = {pixel[0] - color[0], pixel[1] - color[1], pixel[2] - color[2]};
+		Kernel::template SpreadSum<Step>(rows, x, error);
+	}
+}
+
+template<class Kernel, bool Serpentine>
+ErrorDiffusion<Kernel, Serpentine>::ErrorDiffusion(const PaletteLookup& lookup, int width, int channels, DiffusionPrecision precision) :
+	mLookup(lookup),
+	mWidth(width),
+	mChannels(channels),
+	mPrecision(precision),
+	mState(StateSize<Kernel>(width) * Kernel::kRows, 0)
+{
+}
+
+template<class Kernel, bool Serpentine>
+void ErrorDiffusion<Kernel, Serpentine>::ProcessRow(const uint8_t* const rows[], uint8_t* indices)
+{
+	const size_t stateSize = StateSize<Kernel>(mWidth);
+	int32_t* state[Kernel::kRows];
+	for(int dy = 0; dy < Kernel::kRows; ++dy)
+		state[dy] = mState.data() + ((mRow + dy) % Kernel::kRows) * stateSize + Kernel::kRadius * 3;
+
+	// Rows that enter the window start out as plain source values or without error. Rows past the end are
+	// written to, but never read.
+	const int numEntering = mRow == 0 ? Kernel::kRows : 1;
+	for(int dy = Kernel::kRows - numEntering; dy < Kernel::kRows; ++dy)
+	{
+		if(mPrecision == DiffusionPrecision::ACCUMULATE)
+			std::fill(state[dy] - Kernel::kRadius * 3, state[dy] - Kernel::kRadius * 3 + stateSize, 0);
+		else if(rows[dy])
+			LoadRow(rows[dy], mWidth, mChannels, state[dy]);
+	}
+
+	const bool reverse = Serpentine && (mRow & 1);
+	if(mPrecision == DiffusionPrecision::REFERENCE)
+	{
+		if(reverse)
+			DiffuseReference<Kernel, -1>(mLookup, state, 0, mWidth, indices);
+		else
+			DiffuseReference<Kernel, 1>(mLookup, state, 0, mWidth, indices);
+	}
+	else
+	{
+		if(reverse)
+			DiffuseAccumulate<Kernel, -1>(mLookup, rows[0], mChannels, state, 0, mWidth, indices);
+		else
+			DiffuseAccumulate<Kernel, 1>(mLookup, rows[0], mChannels, state, 0, mWidth, indices);
+	}
+
+	++mRow;
+}
+
+template class ErrorDiffusion<FloydSteinbergKernel, false>;
+template class ErrorDiffusion<FloydSteinbergKernel, true>;
+template class ErrorDiffusion<AtkinsonKernel, false>;
+template class ErrorDiffusion<AtkinsonKernel, true>;
+template class ErrorDiffusion<SierraKernel, false>;
+template class ErrorDiffusion<SierraKernel, true>;
+template class ErrorDiffusion<JarvisKernel, false>;
+template class ErrorDiffusion<JarvisKernel, true>;
+
+template<class Kernel, bool Serpentine>
+static void DiffuseErrorSerial(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, DiffusionPrecision precision, uint8_t* indices)
+{
+	const size_t rowSize = static_cast<size_t>(width) * channels;
+	ErrorDiffusion<Kernel, Serpentine> diffusion(lookup, width, channels, precision);
+	for(int y = 0; y < height; ++y)
+	{
+		const uint8_t* rows[Kernel::kRows];
+		for(int dy = 0; dy < Kernel::kRows; ++dy)
+			rows[dy] = (y + dy < height) ? image + (y + dy) * rowSize : nullptr;
+		diffusion.ProcessRow(rows, indices + static_cast<size_t>(y) * width);
+	}
+}
+
+/// Diagonal wavefront: Each row runs on its own thread, trailing the row above by 2 * Kernel::kRadius + 1 pixels
+/** A pixel adds error to pixels up to kRadius to the right in its own row, and all rows above must be done with
+	these before, so every pixel goes through exactly the same operations in the same order as in the serial
+	version. State rows are kept in a ring buffer with enough slots for all rows in flight and the rows below. */
+template<class Kernel>
+static void DiffuseErrorWavefront(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, DiffusionPrecision precision, uint8_t* indices, int numThreads)
+{
+	constexpr int lag = 2 * Kernel::kRadius + 1;
+	const size_t rowSize = static_cast<size_t>(width) * channels;
+	const size_t stateSize = StateSize<Kernel>(width);
+	const int numSlots = numThreads + Kernel::kRows;
+	std::vector<int32_t> state(stateSize * numSlots, 0);
+	auto slot = [&](int y) {return state.data() + (y % numSlots) * stateSize + Kernel::kRadius * 3;};
+
+	std::unique_ptr<std::atomic<int>[]> progress(new std::atomic<int>[height]);
+	for(int y = 0; y < height; ++y)
+		progress[y].store(0, std::memory_order_relaxed);
+	auto waitFor = [&](int y, int numPixels)
+	{
+		if(y < 0)
+			return;
+		while(progress[y].load(std::memory_order_acquire) < numPixels)
+			std::this_thread::yield();
+	};
+
+	if(precision == DiffusionPrecision::REFERENCE)
+	{
+		for(int y = 0; y < std::min(Kernel::kRows - 1, height); ++y)
+			LoadRow(image + y * rowSize, width, channels, slot(y));
+	}
+
+	ParallelFor(0, height, numThreads, [&](int y)
+	{
+		const uint8_t* row = image + y * rowSize;
+		int32_t* rows[Kernel::kRows];
+		for(int dy = 0; dy < Kernel::kRows; ++dy)
+			rows[dy] = slot(y + dy);
+
+		// The slot for the entering row must not be in use by an older row anymore:
+		const int entering = y + Kernel::kRows - 1;
+		waitFor(entering - numSlots, width);
+		if(precision == DiffusionPrecision::REFERENCE)
+		{
+			if(entering < height)
+				LoadRow(image + entering * rowSize, width, channels, rows[Kernel::kRows - 1]);
+		}
+		else
+			std::fill(rows[Kernel::kRows - 1] - Kernel::kRadius * 3, rows[Kernel::kRows - 1] - Kernel::kRadius * 3 + stateSize, 0);
+
+		for(int begin = 0; begin < width; begin += kWavefrontChunk)
+		{
+			const int end = std::min(begin + kWavefrontChunk, width);
+			waitFor(y - 1, std::min(end - 1 + lag, width));
+			if(precision == DiffusionPrecision::REFERENCE)
+				DiffuseReference<Kernel, 1>(lookup, rows, begin, end, indices + static_cast<size_t>(y) * width);
+			else
+				DiffuseAccumulate<Kernel, 1>(lookup, row, channels, rows, begin, end, indices + static_cast<size_t>(y) * width);
+			progress[y].store(end, std::memory_order_release);
+		}
+	});
+}
+
+template<class Kernel>
+static void DiffuseErrorWithKernel(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, bool serpentine,
+								   DiffusionPrecision precision, uint8_t* indices, int numThreads)
+{
+	if(serpentine)
+		DiffuseErrorSerial<Kernel, true>(image, width, height, channels, lookup, precision, indices);
+	else if(numThreads > 1)
+		DiffuseErrorWavefront<Kernel>(image, width, height, channels, lookup, precision, indices, numThreads);
+	else
+		DiffuseErrorSerial<Kernel, false>(image, width, height, channels, lookup, precision, indices);
+}
+
+void DiffuseError(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, DiffusionKernel kernel, bool serpentine,
+				  DiffusionPrecision precision, uint8_t* indices, int numThreads)
+{
+	numThreads = std::min(ResolveThreadCount(numThreads), height);
+	switch(kernel)
+	{
+	case DiffusionKernel::FLOYD_STEINBERG:
+		DiffuseErrorWithKernel<FloydSteinbergKernel>(image, width, height, channels, lookup, serpentine, precision, indices, numThreads);
+		break;
+	case DiffusionKernel::ATKINSON:
+		DiffuseErrorWithKernel<AtkinsonKernel>(image, width, height, channels, lookup, serpentine, precision, indices, numThreads);
+		break;
+	case DiffusionKernel::SIERRA:
+		DiffuseErrorWithKernel<SierraKernel>(image, width, height, channels, lookup, serpentine, precision, indices, numThreads);
+		break;
+	case DiffusionKernel::JARVIS_JUDICE_NINKE:
+		DiffuseErrorWithKernel<JarvisKernel>(image, width, height, channels, lookup, serpentine, precision, indices, numThreads);
+		break;
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef ERRORDIFFUSION_H
+#define ERRORDIFFUSION_H
+
+#include "DitherKernel.h"
+
+#include <cstdint>
+#include <vector>
+
+class PaletteLookup;
+
+/// Arithmetic used to spread the quantization error
+enum class DiffusionPrecision
+{
+	/// Truncate every error term and clamp the receiving pixel after each term
+	/** Bit-identical to the original floating point implementation. Use this where output must stay stable. */
+	REFERENCE,
+
+	/// Sum up error terms in units of the kernel divisor and round and clamp once per pixel
+	/** Faster and loses less of the error, but the output differs slightly from REFERENCE. */
+	ACCUMULATE
+};
+
+/// Error diffusion kernels selectable at runtime. See DitherKernel.h.
+enum class DiffusionKernel
+{
+	FLOYD_STEINBERG,
+	ATKINSON,
+	SIERRA,
+	JARVIS_JUDICE_NINKE
+};
+
+/// Error diffusion, one row at a time
+/** All arithmetic is done in integers. Only Kernel::kRows rows of working state are kept, so memory use is
+	O(width) regardless of the image height. Source rows are read directly from interleaved 8 bit pixels.
+	@tparam Kernel A DitherKernel.
+	@tparam Serpentine Scan every other row from right to left, which avoids diagonal artifacts. */
+template<class Kernel, bool Serpentine = false>
+class ErrorDiffusion
+{
+public:
+	/// @param channels Bytes per source pixel. Only the first three are used.
+	ErrorDiffusion(const PaletteLookup& lookup, int width, int channels, DiffusionPrecision precision = DiffusionPrecision::REFERENCE);
+
+	/// Quantize the next row
+	/** @param rows Source pixels of this row and the Kernel::kRows - 1 rows below, nullptr past the last row.
+		@param indices Output, width entries. */
+	void ProcessRow(const uint8_t* const rows[], uint8_t* indices);
+
+private:
+	const PaletteLookup& mLookup;
+	const int mWidth;
+	const int mChannels;
+	const DiffusionPrecision mPrecision;
+	int mRow = 0;
+
+	/// Ring of Kernel::kRows padded rows
+	/** REFERENCE: Clamped pixel values. ACCUMULATE: Error sums in 1/Kernel::kDivisor units. */
+	std::vector<int32_t> mState;
+};
+
+/// Dither a whole interleaved 8 bit image with ErrorDiffusion
+/** With more than one thread, rows are processed in a diagonal wavefront: Each row trails the one above it by a
+	few pixels, so several rows run at once. The output is byte-identical to the serial version. Serpentine scans
+	always run serially, because a right-to-left row needs the whole row above.
+	@param numThreads 0 uses all hardware threads. */
+void DiffuseError(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, DiffusionKernel kernel, bool serpentine,
+				  DiffusionPrecision precision, uint8_t* indices, int numThreads = 1);
+
+#endif // ERRORDIFFUSION_H
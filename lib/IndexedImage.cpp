@@ -0,0 +1,306 @@
+#include "IndexedImage.h"
+#include "MappedFile.h"
+
+#include <stb_image.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+/// Entries of the target palette that a search considers. Fire and fullbright colors are left out.
+static constexpr int kNumSearchedColors = 224;
+
+/// Images larger than this in any direction are left to stb_image
+static constexpr uint32_t kMaxSize = 1 << 16;
+
+static uint32_t ReadBigEndian32(const uint8_t* data)
+{
+	return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+static uint32_t ReadLittleEndian32(const uint8_t* data)
+{
+	return data[0] | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+}
+
+static uint16_t ReadLittleEndian16(const uint8_t* data)
+{
+	return data[0] | (data[1] << 8);
+}
+
+std::unique_ptr<IndexedImage> IndexedImage::TryLoad(const char* filename)
+{
+	const MappedFile file(filename);
+	return TryLoad(file.GetData(), file.GetSize());
+}
+
+std::unique_ptr<IndexedImage> IndexedImage::TryLoad(const uint8_t* data, size_t size)
+{
+	std::unique_ptr<IndexedImage> image(new IndexedImage);
+	image->mPalette.resize(256 * 4, 0);
+	for(int i = 0; i < 256; ++i)
+		image->mPalette[i * 4 + 3] = 255;
+
+	if(ReadPng(data, size, *image) || ReadPcx(data, size, *image) || ReadBmp(data, size, *image))
+		return image;
+	return nullptr;
+}
+
+bool IndexedImage::ReadPng(const uint8_t* data, size_t size, IndexedImage& image)
+{
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if(size < 8 || std::memcmp(data, signature, 8) != 0)
+		return false;
+
+	int bitDepth = 0;
+	std::vector<uint8_t> compressed;
+	size_t offset = 8;
+	bool end = false;
+	while(!end)
+	{
+		if(offset + 12 > size)
+			return false;
+		const uint32_t length = ReadBigEndian32(data + offset);
+		const uint8_t* type = data + offset + 4;
+		const uint8_t* chunk = data + offset + 8;
+		if(length > size - offset - 12)
+			return false;
+
+		if(std::memcmp(type, "IHDR", 4) == 0)
+		{
+			if(length < 13)
+				return false;
+			image.mWidth = ReadBigEndian32(chunk);
+			image.mHeight = ReadBigEndian32(chunk + 4);
+			bitDepth = chunk[8];
+			const int colorType = chunk[9];
+			const int interlace = chunk[12];
+			if(colorType != 3 || interlace != 0 || (bitDepth != 1 && bitDepth != 2 && bitDepth != 4 && bitDepth != 8))
+				return false;
+			if(image.mWidth == 0 || image.mHeight == 0 || uint32_t(image.mWidth) > kMaxSize || uint32_t(image.mHeight) > kMaxSize)
+				return false;
+		}
+		else if(std::memcmp(type, "PLTE", 4) == 0)
+		{
+			for(uint32_t i = 0; i < std::min(length / 3, 256u); ++i)
+				std::memcpy(image.mPalette.data() + i * 4, chunk + i * 3, 3);
+		}
+		else if(std::memcmp(type, "tRNS", 4) == 0)
+		{
+			for(uint32_t i = 0; i < std::min(length, 256u); ++i)
+				image.mPalette[i * 4 + 3] = chunk[i];
+		}
+		else if(std::memcmp(type, "IDAT", 4) == 0)
+			compressed.insert(compressed.end(), chunk, chunk + length);
+		else if(std::memcmp(type, "IEND", 4) == 0)
+			end = true;
+
+		offset += length + 12;
+	}
+	if(bitDepth == 0 || compressed.empty())
+		return false;
+
+	// One filter type byte per row:
+	const size_t stride = (static_cast<size_t>(image.mWidth) * bitDepth + 7) / 8;
+	if(image.mHeight * (stride + 1) > static_cast<size_t>(std::numeric_limits<int>::max()))
+		return false;
+	std::vector<uint8_t> filtered(image.mHeight * (stride + 1));
+	const int decodedSize = stbi_zlib_decode_buffer(reinterpret_cast<char*>(filtered.data()), filtered.size(),
+			reinterpret_cast<const char*>(compressed.data()), compressed.size());
+	if(decodedSize != static_cast<int>(filtered.size()))
+		return false;
+
+	// Undo filters. With less than 8 bits per pixel, the left neighbour is still the previous byte.
+	std::vector<uint8_t> previous(stride, 0);
+	std::vector<uint8_t> current(stride);
+	image.mIndices.resize(static_cast<size_t>(image.mWidth) * image.mHeight);
+	const int pixelsPerByte = 8 / bitDepth;
+	const int mask = (1 << bitDepth) - 1;
+	for(int y = 0; y < image.mHeight; ++y)
+	{
+		const uint8_t* row = filtered.data() + y * (stride + 1);
+		const int filter = row[0];
+		for(size_t x = 0; x < stride; ++x)
+		{
+			const int a = x > 0 ? current[x - 1] : 0;
+			const int b = previous[x];
+			const int c = x > 0 ? previous[x - 1] : 0;
+			int predictor = 0;
+			switch(filter)
+			{
+			case 0: predictor = 0; break;
+			case 1: predictor = a; break;
+			case 2: predictor = b; break;
+			case 3: predictor = (a + b) / 2; break;
+			case 4:
+			{
+				const int p = a + b - c;
+				const int pa = std::abs(p - a);
+				const int pb = std::abs(p - b);
+				const int pc = std::abs(p - c);
+				predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+				break;
+			}
+			default: return false;
+			}
+			current[x] = row[x + 1] + predictor;
+		}
+
+		uint8_t* indices = image.mIndices.data() + static_cast<size_t>(y) * image.mWidth;
+		for(int x = 0; x < image.mWidth; ++x)
+		{
+			const int shift = 8 - bitDepth * (x % pixelsPerByte + 1);
+			indices[x] = (current[x / pixelsPerByte] >> shift) & mask;
+		}
+		previous.swap(current);
+	}
+	return true;
+}
+
+bool IndexedImage::ReadPcx(const uint8_t* data, size_t size, IndexedImage& image)
+{
+	// 128 byte header, then RLE data, then a marker byte and the palette:
+	if(size < 128 + 769 || data[0] != 0x0a || data[2] != 1 || data[3] != 8 || data[65] != 1)
+		return false;
+	const uint8_t* palette = data + size - 768;
+	if(palette[-1] != 0x0c)
+		return false;
+
+	image.mWidth = ReadLittleEndian16(data + 8) - ReadLittleEndian16(data + 4) + 1;
+	image.mHeight = ReadLittleEndian16(data + 10) - ReadLittleEndian16(data + 6) + 1;
+	const int bytesPerLine = ReadLittleEndian16(data + 66);
+	if(image.mWidth <= 0 || image.mHeight <= 0 || bytesPerLine < image.mWidth)
+		return false;
+
+	for(int i = 0; i < 256; ++i)
+		std::memcpy(image.mPalette.data() + i * 4, palette + i * 3, 3);
+
+	image.mIndices.resize(static_cast<size_t>(image.mWidth) * image.mHeight);
+	const uint8_t* in = data + 128;
+	const uint8_t* inEnd = palette - 1;
+	for(int y = 0; y < image.mHeight; ++y)
+	{
+		uint8_t* indices = image.mIndices.data() + static_cast<size_t>(y) * image.mWidth;
+		int x = 0;
+		while(x < bytesPerLine)
+		{
+			if(in == inEnd)
+				return false;
+			int count = 1;
+			uint8_t value = *in++;
+			if((value & 0xc0) == 0xc0)
+			{
+				if(in == inEnd)
+					return false;
+				count = value & 0x3f;
+				value = *in++;
+			}
+			// Runs may cross the padding at the end of the line, but not into the next line:
+			for(; count > 0 && x < bytesPerLine; --count, ++x)
+			{
+				if(x < image.mWidth)
+					indices[x] = value;
+			}
+		}
+	}
+	return true;
+}
+
+bool IndexedImage::ReadBmp(const uint8_t* data, size_t size, IndexedImage& image)
+{
+	if(size < 54 || data[0] != 'B' || data[1] != 'M')
+		return false;
+	const uint32_t pixelOffset = ReadLittleEndian32(data + 10);
+	const uint32_t headerSize = ReadLittleEndian32(data + 14);
+	const int32_t width = ReadLittleEndian32(data + 18);
+	const int32_t height = ReadLittleEndian32(data + 22);
+	const int bitsPerPixel = ReadLittleEndian16(data + 28);
+	const uint32_t compression = ReadLittleEndian32(data + 30);
+	uint32_t numColors = ReadLittleEndian32(data + 46);
+
+	// BITMAPINFOHEADER or later, 8 bit, BI_RGB:
+	if(headerSize < 40 || bitsPerPixel != 8 || compression != 0)
+		return false;
+	// std::abs() of the lowest height would overflow:
+	if(width <= 0 || height == 0 || height == std::numeric_limits<int32_t>::min() || uint32_t(width) > kMaxSize || uint32_t(std::abs(height)) > kMaxSize)
+		return false;
+	if(numColors == 0 || numColors > 256)
+		numColors = 256;
+
+	const size_t paletteOffset = 14 + size_t(headerSize);
+	if(paletteOffset + numColors * 4 > size)
+		return false;
+	for(uint32_t i = 0; i < numColors; ++i)
+	{
+		const uint8_t* bgra = data + paletteOffset + i * 4;
+		image.mPalette[i * 4] = bgra[2];
+		image.mPalette[i * 4 + 1] = bgra[1];
+		image.mPalette[i * 4 + 2] = bgra[0];
+	}
+
+	image.mWidth = width;
+	image.mHeight = std::abs(height);
+	const size_t stride = (static_cast<size_t>(width) + 3) & ~size_t(3);
+	if(pixelOffset > size || stride * image.mHeight > size - pixelOffset)
+		return false;
+
+	// Rows are stored bottom-up, unless the height is negative:
+	image.mIndices.resize(static_cast<size_t>(image.mWidth) * image.mHeight);
+	for(int y = 0; y < image.mHeight; ++y)
+	{
+		const int fileRow = height > 0 ? image.mHeight - 1 - y : y;
+		std::memcpy(image.mIndices.data() + static_cast<size_t>(y) * image.mWidth, data + pixelOffset + fileRow * stride, image.mWidth);
+	}
+	return true;
+}
+
+std::vector<uint8_t> IndexedImage::Remap(const uint8_t* palette) const
+{
+	bool used[256] = {};
+	for(uint8_t index: mIndices)
+		used[index] = true;
+
+	auto transparent = [&](int index) {return mPalette[index * 4 + 3] < 128;};
+	auto sameColor = [&](int index, int target) {return std::memcmp(mPalette.data() + index * 4, palette + target * 3, 3) == 0;};
+
+	// Even a matching palette is searched, because fullbright colors and duplicate entries must map like in the
+	// RGBA conversion, which only considers the first 224 entries:
+	uint8_t table[256] = {};
+	for(int i = 0; i < 256; ++i)
+	{
+		if(transparent(i))
+		{
+			table[i] = 255;
+			continue;
+		}
+		if(!used[i])
+			continue;
+		int target = 0;
+		while(target < kNumSearchedColors && !sameColor(i, target))
+			++target;
+		if(target == kNumSearchedColors)
+			return std::vector<uint8_t>();
+		table[i] = target;
+	}
+
+	std::vector<uint8_t> indices(mIndices.size());
+	for(size_t i = 0; i < indices.size(); ++i)
+		indices[i] = table[mIndices[i]];
+	return indices;
+}
+
+std::vector<uint8_t> IndexedImage::ToRgba() const
+{
+	std::vector<uint8_t> rgba(mIndices.size() * 4);
+	for(int y = 0; y < mHeight; ++y)
+		ExpandRow(y, rgba.data() + static_cast<size_t>(y) * mWidth * 4);
+	return rgba;
+}
+
+void IndexedImage::ExpandRow(int y, uint8_t* rgba) const
+{
+	const uint8_t* indices = mIndices.data() + static_cast<size_t>(y) * mWidth;
+	for(int x = 0; x < mWidth; ++x)
+		std::memcpy(rgba + x * 4, mPalette.data() + indices[x] * 4, 4);
+}
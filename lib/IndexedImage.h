@@ -0,0 +1,56 @@
+#ifndef INDEXEDIMAGE_H
+#define INDEXEDIMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// 8 bit indexed image with its embedded palette, read from PNG, PCX or BMP without expanding to RGBA
+/** Artists often deliver images that already use the Quake palette. Keeping the indices allows converting these
+	without any palette search. */
+class IndexedImage
+{
+public:
+	/// Load file if it is an indexed image in a supported format
+	/** Supported are non-interlaced PNG with color type 3 and 1, 2, 4 or 8 bits, 8 bit single plane PCX and
+		uncompressed 8 bit BMP.
+		@return nullptr for all other files, including broken ones. Let stb_image report errors for these. */
+	static std::unique_ptr<IndexedImage> TryLoad(const char* filename);
+
+	/// Load from memory, see TryLoad()
+	static std::unique_ptr<IndexedImage> TryLoad(const uint8_t* data, size_t size);
+
+	int GetWidth() const {return mWidth;}
+	int GetHeight() const {return mHeight;}
+
+	/// Map to indices into a Quake palette without searching
+	/** Every used color must appear exactly among the first 224 entries, and maps to the lowest such index,
+		which is what a palette search would return. This holds even if the image already uses the target palette,
+		so fullbright colors and index 255 are mapped like in the RGBA conversion. Colors with alpha below 50% map
+		to 255.
+		@param palette 256 RGB entries.
+		@return Empty if some color can't be mapped exactly. */
+	std::vector<uint8_t> Remap(const uint8_t* palette) const;
+
+	/// Expand to RGBA, like stb_image does
+	std::vector<uint8_t> ToRgba() const;
+
+	/// Expand row y to RGBA, GetWidth() * 4 bytes
+	void ExpandRow(int y, uint8_t* rgba) const;
+
+private:
+	IndexedImage() = default;
+
+	static bool ReadPng(const uint8_t* data, size_t size, IndexedImage& image);
+	static bool ReadPcx(const uint8_t* data, size_t size, IndexedImage& image);
+	static bool ReadBmp(const uint8_t* data, size_t size, IndexedImage& image);
+
+	int mWidth = 0;
+	int mHeight = 0;
+	std::vector<uint8_t> mIndices;
+
+	/// 256 RGBA entries. Entries not in the file are opaque black.
+	std::vector<uint8_t> mPalette;
+};
+
+#endif // INDEXEDIMAGE_H
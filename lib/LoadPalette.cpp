@@ -1,46 +1,35 @@
 #include "LoadPalette.h"
+#include "MappedFile.h"
 #include "StbImage.h"
 
-#include <molecular/util/FileStreamStorage.h>
+#include <stb_image.h>
 
-using namespace molecular::util;
+#include <stdexcept>
 
-static std::vector<uint8_t> TryLoadFromImage(const char* filename)
+static std::vector<uint8_t> TryLoadFromImage(const MappedFile& file)
 {
-	std::vector<uint8_t> palette;
 	int width = 0;
 	int height = 0;
-	try
-	{
-		StbImage image(filename, 3);
-		width = image.GetWidth();
-		height = image.GetHeight();
-		if(width == 16 && height == 16)
-		{
-			palette.resize(width * height * 3);
-			std::memcpy(palette.data(), image.Data(), width * height * 3);
-		}
-	}
-	catch(...)
-	{
+	int channels = 0;
+	if(!stbi_info_from_memory(file.GetData(), file.GetSize(), &width, &height, &channels))
 		return std::vector<uint8_t>();
-	}
-
 	if(width != 16 || height != 16)
 		throw std::runtime_error("Palette image must be 16x16 pixels in size");
-	return std::vector<uint8_t>();
+
+	StbImage image(file.GetData(), file.GetSize(), 3);
+	return std::vector<uint8_t>(image.Data(), image.Data() + 16 * 16 * 3);
 }
 
 std::vector<uint8_t> LoadPaletteFile(const char* filename)
 {
-	std::vector<uint8_t> palette = TryLoadFromImage(filename);
+	// The file is opened once for both kinds:
+	const MappedFile file(filename);
+	std::vector<uint8_t> palette = TryLoadFromImage(file);
 	if(palette.empty())
 	{
-		FileReadStorage storage(filename);
-		if(storage.GetSize() != 768)
+		if(file.GetSize() != 768)
 			throw std::runtime_error("Palette file doesn't seem to be a Quake palette lump file");
-		palette.resize(768);
-		storage.Read(palette.data(), 768);
+		palette.assign(file.GetData(), file.GetData() + 768);
 	}
 	return palette;
 }
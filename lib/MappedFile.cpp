@@ -0,0 +1,55 @@
+#include "MappedFile.h"
+
+#include <molecular/util/FileStreamStorage.h>
+
+#include <stdexcept>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace molecular::util;
+
+MappedFile::MappedFile(const char* filename)
+{
+#ifndef _WIN32
+	const int file = open(filename, O_RDONLY);
+	if(file < 0)
+		throw std::runtime_error(std::string("Could not open file ") + filename);
+
+	struct stat status;
+	const bool hasStatus = fstat(file, &status) == 0;
+	if(hasStatus && status.st_size > 0)
+	{
+		void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if(data != MAP_FAILED)
+		{
+			mData = static_cast<const uint8_t*>(data);
+			mSize = status.st_size;
+			mMapped = true;
+		}
+	}
+	close(file);
+	if(mMapped || (hasStatus && status.st_size == 0))
+		return;
+#endif
+
+	// No mapping possible, read the whole file instead:
+	FileReadStorage storage(filename);
+	mBuffer.resize(storage.GetSize());
+	storage.Read(mBuffer.data(), mBuffer.size());
+	mData = mBuffer.data();
+	mSize = mBuffer.size();
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+	if(mMapped)
+		munmap(const_cast<uint8_t*>(mData), mSize);
+#endif
+}
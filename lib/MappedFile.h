@@ -0,0 +1,34 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Read-only view of a whole file, opened once
+/** The file is memory-mapped where the platform supports it, so only the pages that are actually read are
+	loaded, and the same bytes can be passed to several parsers without opening the file again. Elsewhere, the
+	file is read into memory. */
+class MappedFile
+{
+public:
+	/// Throws std::runtime_error if the file can't be opened
+	explicit MappedFile(const char* filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const uint8_t* GetData() const {return mData;}
+	size_t GetSize() const {return mSize;}
+
+private:
+	const uint8_t* mData = nullptr;
+	size_t mSize = 0;
+	bool mMapped = false;
+
+	/// File contents where mapping is not available
+	std::vector<uint8_t> mBuffer;
+};
+
+#endif // MAPPEDFILE_H
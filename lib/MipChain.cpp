@@ -0,0 +1,261 @@
+#include "MipChain.h"
+#include "BufferPool.h"
+
+#include <algorithm>
+#include <cmath>
+
+/// Entries of the table from linear values in 0..1 to 8 bit sRGB
+static constexpr int kEncodeTableSize = 1 << 13;
+
+/// 8 bit sRGB to linear
+static const float* DecodeTable()
+{
+	static const std::vector<float> table = []()
+	{
+		std::vector<float> table(256);
+		for(int i = 0; i < 256; ++i)
+		{
+			const float value = i / 255.f;
+			table[i] = value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+		}
+		return table;
+	}();
+	return table.data();
+}
+
+/// Linear in steps of 1 / (kEncodeTableSize - 1) to 8 bit sRGB
+static const uint8_t* EncodeTable()
+{
+	static const std::vector<uint8_t> table = []()
+	{
+		std::vector<uint8_t> table(kEncodeTableSize);
+		for(int i = 0; i < kEncodeTableSize; ++i)
+		{
+			const float value = float(i) / (kEncodeTableSize - 1);
+			const float encoded = value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.f / 2.4f) - 0.055f;
+			table[i] = static_cast<uint8_t>(std::clamp<int>(encoded * 255.f + 0.5f, 0, 255));
+		}
+		return table;
+	}();
+	return table.data();
+}
+
+template<class T>
+static std::vector<T> AcquireBuffer(BufferPool* pool, size_t size);
+
+template<>
+std::vector<uint8_t> AcquireBuffer(BufferPool* pool, size_t size)
+{
+	return pool ? pool->AcquireBytes(size) : std::vector<uint8_t>(size);
+}
+
+template<>
+std::vector<float> AcquireBuffer(BufferPool* pool, size_t size)
+{
+	return pool ? pool->AcquireFloats(size) : std::vector<float>(size);
+}
+
+/// Average a 2x2 block of linear values
+/** @param fetch Returns the linear value of channel c of block pixel i, in reading order. */
+template<class Fetch>
+static void AverageBlock(int channels, float* pixel, Fetch fetch)
+{
+	const bool hasAlpha = channels == 4;
+	const int numColors = hasAlpha ? 3 : channels;
+
+	float weights[4] = {1.f, 1.f, 1.f, 1.f};
+	float weightSum = 4.f;
+	if(hasAlpha)
+	{
+		float alphaSum = 0;
+		for(int i = 0; i < 4; ++i)
+		{
+			weights[i] = fetch(i, 3);
+			alphaSum += weights[i];
+		}
+		pixel[3] = alphaSum * 0.25f;
+
+		// Plain average if all four pixels are fully transparent:
+		if(alphaSum > 0)
+			weightSum = alphaSum;
+		else
+			std::fill(weights, weights + 4, 1.f);
+	}
+
+	for(int c = 0; c < numColors; ++c)
+	{
+		float sum = 0;
+		for(int i = 0; i < 4; ++i)
+			sum += fetch(i, c) * weights[i];
+		pixel[c] = sum / weightSum;
+	}
+}
+
+/// Average 2x2 blocks of linear values
+/** @param fetch Returns the linear value of channel c of pixel i of the source image. */
+template<class Fetch>
+static std::vector<float> Halve(int width, int height, int channels, BufferPool* pool, Fetch fetch)
+{
+	const int newWidth = width / 2;
+	const int newHeight = height / 2;
+	std::vector<float> out = AcquireBuffer<float>(pool, static_cast<size_t>(newWidth) * newHeight * channels);
+	for(int y = 0; y < newHeight; ++y)
+	{
+		for(int x = 0; x < newWidth; ++x)
+		{
+			const size_t top = static_cast<size_t>(2 * y) * width + 2 * x;
+			const size_t block[4] = {top, top + 1, top + width, top + width + 1};
+			float* pixel = out.data() + (static_cast<size_t>(y) * newWidth + x) * channels;
+			AverageBlock(channels, pixel, [&](int i, int c) {return fetch(block[i], c);});
+		}
+	}
+	return out;
+}
+
+/// Linear values to 8 bit sRGB. With 4 channels, the fourth is linear alpha.
+static void Encode(const float* linear, size_t size, bool hasAlpha, uint8_t* out)
+{
+	const uint8_t* encode = EncodeTable();
+	for(size_t i = 0; i < size; ++i)
+	{
+		const float value = std::clamp(linear[i], 0.f, 1.f);
+		if(hasAlpha && i % 4 == 3)
+			out[i] = static_cast<uint8_t>(value * 255.f + 0.5f);
+		else
+			out[i] = encode[static_cast<int>(value * (kEncodeTableSize - 1) + 0.5f)];
+	}
+}
+
+std::vector<MipImage<uint8_t>> BuildMipChain(const uint8_t* image, int width, int height, int channels, int numLevels, BufferPool* pool)
+{
+	const float* decode = DecodeTable();
+	const bool hasAlpha = channels == 4;
+
+	std::vector<MipImage<uint8_t>> chain(numLevels);
+	chain[0].width = width;
+	chain[0].height = height;
+	chain[0].pixels = image;
+
+	// Only the linear version of the previous level is kept:
+	std::vector<float> linear;
+	for(int level = 1; level < numLevels; ++level)
+	{
+		std::vector<float> next;
+		if(level == 1)
+		{
+			next = Halve(width, height, channels, pool, [&](size_t i, int c)
+			{
+				const uint8_t value = image[i * channels + c];
+				return (hasAlpha && c == 3) ? value / 255.f : decode[value];
+			});
+		}
+		else
+			next = Halve(width, height, channels, pool, [&](size_t i, int c) {return linear[i * channels + c];});
+		if(pool)
+			pool->Release(std::move(linear));
+		linear = std::move(next);
+		width /= 2;
+		height /= 2;
+
+		MipImage<uint8_t>& mip = chain[level];
+		mip.width = width;
+		mip.height = height;
+		mip.storage = AcquireBuffer<uint8_t>(pool, linear.size());
+		Encode(linear.data(), linear.size(), hasAlpha, mip.storage.data());
+		mip.pixels = mip.storage.data();
+	}
+	if(pool)
+		pool->Release(std::move(linear));
+	return chain;
+}
+
+std::vector<MipImage<float>> BuildMipChain(const float* image, int width, int height, int channels, int numLevels, BufferPool* pool)
+{
+	std::vector<MipImage<float>> chain(numLevels);
+	chain[0].width = width;
+	chain[0].height = height;
+	chain[0].pixels = image;
+
+	for(int level = 1; level < numLevels; ++level)
+	{
+		const float* previous = chain[level - 1].pixels;
+		MipImage<float>& mip = chain[level];
+		mip.storage = Halve(width, height, channels, pool, [&](size_t i, int c) {return previous[i * channels + c];});
+		mip.pixels = mip.storage.data();
+		width /= 2;
+		height /= 2;
+		mip.width = width;
+		mip.height = height;
+	}
+	return chain;
+}
+
+void ReleaseMipChain(std::vector<MipImage<uint8_t>>& chain, BufferPool& pool)
+{
+	for(MipImage<uint8_t>& mip: chain)
+		pool.Release(std::move(mip.storage));
+	chain.clear();
+}
+
+void ReleaseMipChain(std::vector<MipImage<float>>& chain, BufferPool& pool)
+{
+	for(MipImage<float>& mip: chain)
+		pool.Release(std::move(mip.storage));
+	chain.clear();
+}
+
+MipChainStream::MipChainStream(int width, int channels, int numLevels, RowSink sink) :
+	mWidth(width),
+	mChannels(channels),
+	mSink(std::move(sink)),
+	mLevels(numLevels)
+{
+	for(int level = 1; level < numLevels; ++level)
+	{
+		mLevels[level].top.resize(static_cast<size_t>(width >> (level - 1)) * channels);
+		mLevels[level].linear.resize(static_cast<size_t>(width >> level) * channels);
+		mLevels[level].encoded.resize(static_cast<size_t>(width >> level) * channels);
+	}
+	if(numLevels > 1)
+		mLinearRow.resize(static_cast<size_t>(width) * channels);
+}
+
+void MipChainStream::PushRow(const uint8_t* row)
+{
+	mSink(0, mLevels[0].numRows++, row);
+	if(mLevels.size() == 1)
+		return;
+
+	const float* decode = DecodeTable();
+	const bool hasAlpha = mChannels == 4;
+	for(size_t i = 0; i < mLinearRow.size(); ++i)
+		mLinearRow[i] = (hasAlpha && i % 4 == 3) ? row[i] / 255.f : decode[row[i]];
+	AddLinearRow(0, mLinearRow.data());
+}
+
+void MipChainStream::AddLinearRow(int level, const float* row)
+{
+	if(level + 1 == static_cast<int>(mLevels.size()))
+		return;
+
+	// Rows of a level come in pairs, the first one waits for the second:
+	Level& next = mLevels[level + 1];
+	if(!next.hasTop)
+	{
+		std::copy(row, row + next.top.size(), next.top.begin());
+		next.hasTop = true;
+		return;
+	}
+	next.hasTop = false;
+
+	const int newWidth = (mWidth >> level) / 2;
+	for(int x = 0; x < newWidth; ++x)
+	{
+		const float* block[4] = {next.top.data() + 2 * x * mChannels, next.top.data() + (2 * x + 1) * mChannels,
+								 row + 2 * x * mChannels, row + (2 * x + 1) * mChannels};
+		AverageBlock(mChannels, next.linear.data() + x * mChannels, [&](int i, int c) {return block[i][c];});
+	}
+	Encode(next.linear.data(), next.linear.size(), mChannels == 4, next.encoded.data());
+	mSink(level + 1, next.numRows++, next.encoded.data());
+	AddLinearRow(level + 1, next.linear.data());
+}
@@ -0,0 +1,80 @@
+#ifndef MIPCHAIN_H
+#define MIPCHAIN_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class BufferPool;
+
+/// Image of one MIP level, interleaved
+template<class T>
+struct MipImage
+{
+	int width = 0;
+	int height = 0;
+
+	/// Points into storage, or to the source image for level 0
+	const T* pixels = nullptr;
+
+	std::vector<T> storage;
+};
+
+/// MIP levels 0 to numLevels - 1 of an 8 bit sRGB image
+/** Every level is derived from the one above it by averaging 2x2 pixels in linear light, so the source is read
+	only once. Odd rows and columns at the right and bottom edges are dropped. With 4 channels, the fourth is
+	linear alpha, and colors are weighted by it, so that fully transparent pixels don't bleed into their
+	neighbours.
+	Level 0 points to the source image without copying, so the source must outlive the chain.
+	@param pool Where to get the level and working buffers from, or nullptr. */
+std::vector<MipImage<uint8_t>> BuildMipChain(const uint8_t* image, int width, int height, int channels, int numLevels, BufferPool* pool = nullptr);
+
+/// MIP levels of a linear float image, see above
+std::vector<MipImage<float>> BuildMipChain(const float* image, int width, int height, int channels, int numLevels, BufferPool* pool = nullptr);
+
+/// Give the level buffers back to the pool
+void ReleaseMipChain(std::vector<MipImage<uint8_t>>& chain, BufferPool& pool);
+void ReleaseMipChain(std::vector<MipImage<float>>& chain, BufferPool& pool);
+
+/// BuildMipChain() for an 8 bit sRGB image that arrives one row at a time
+/** Same filter and output, but only a row or two of linear values is kept per level, so memory use does not
+	depend on the image height. */
+class MipChainStream
+{
+public:
+	/// Receives row y of a level, with width >> level pixels. Rows of each level arrive in order.
+	using RowSink = std::function<void(int level, int y, const uint8_t* row)>;
+
+	MipChainStream(int width, int channels, int numLevels, RowSink sink);
+
+	/// Add the next row of level 0
+	/** It is passed on to the sink as it is, followed by any rows of smaller levels that it completes. */
+	void PushRow(const uint8_t* row);
+
+private:
+	/// Add a row of linear values of a level, and build the level below from it
+	void AddLinearRow(int level, const float* row);
+
+	struct Level
+	{
+		int numRows = 0;
+
+		/// Upper row of the next 2x2 blocks, from the level above. Waits for the lower one.
+		std::vector<float> top;
+		bool hasTop = false;
+
+		/// Last row of this level
+		std::vector<float> linear;
+		std::vector<uint8_t> encoded;
+	};
+
+	const int mWidth;
+	const int mChannels;
+	const RowSink mSink;
+	std::vector<Level> mLevels;
+
+	/// Level 0 row decoded to linear
+	std::vector<float> mLinearRow;
+};
+
+#endif // MIPCHAIN_H
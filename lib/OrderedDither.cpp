@@ -0,0 +1,188 @@
+#include "OrderedDither.h"
+#include "PaletteLookup.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+/// Total range of the offsets. Roughly the distance between neighbouring colors of a Quake palette ramp.
+static constexpr int kSpread = 32;
+
+/// Width of the gaussian used to measure clustering in void-and-cluster
+static constexpr float kSigma = 1.5f;
+
+/// Rows per work item in OrderedDither
+static constexpr int kRowsPerBand = 16;
+
+ThresholdMap::ThresholdMap(int size, const std::vector<int>& ranks) :
+	mSize(size),
+	mOffsets(size * size)
+{
+	// Centered in each rank's interval, so the offsets average out to zero:
+	const int numCells = size * size;
+	for(int i = 0; i < numCells; ++i)
+		mOffsets[i] = (2 * ranks[i] + 1) * kSpread / (2 * numCells) - kSpread / 2;
+}
+
+/// Recursive Bayer matrix: M(2n) = [4M, 4M + 2; 4M + 3, 4M + 1]
+static std::vector<int> BayerRanks(int size)
+{
+	std::vector<int> ranks(1, 0);
+	for(int n = 1; n < size; n *= 2)
+	{
+		std::vector<int> bigger(4 * n * n);
+		for(int y = 0; y < n; ++y)
+		{
+			for(int x = 0; x < n; ++x)
+			{
+				const int value = 4 * ranks[y * n + x];
+				bigger[y * 2 * n + x] = value;
+				bigger[y * 2 * n + x + n] = value + 2;
+				bigger[(y + n) * 2 * n + x] = value + 3;
+				bigger[(y + n) * 2 * n + x + n] = value + 1;
+			}
+		}
+		ranks.swap(bigger);
+	}
+	return ranks;
+}
+
+/// Void-and-cluster (Ulichney 1993) on a torus
+/** Energy is the sum of a gaussian around every set cell. The tightest cluster is the set cell with the highest
+	energy, the largest void the free cell with the lowest. Filling the upper half by largest void is equivalent to
+	taking the tightest cluster of the inverted pattern, so the third phase of the original method falls away. */
+static std::vector<int> VoidAndClusterRanks(int size)
+{
+	const int numCells = size * size;
+	const int mask = size - 1;
+
+	std::vector<float> kernel(numCells);
+	for(int y = 0; y < size; ++y)
+	{
+		for(int x = 0; x < size; ++x)
+		{
+			const int dx = std::min(x, size - x);
+			const int dy = std::min(y, size - y);
+			kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2 * kSigma * kSigma));
+		}
+	}
+
+	std::vector<char> pattern(numCells, 0);
+	std::vector<float> energy(numCells, 0);
+	auto set = [&](int cell, bool value)
+	{
+		pattern[cell] = value;
+		const float sign = value ? 1.f : -1.f;
+		const int cx = cell % size;
+		const int cy = cell / size;
+		for(int y = 0; y < size; ++y)
+			for(int x = 0; x < size; ++x)
+				energy[((cy + y) & mask) * size + ((cx + x) & mask)] += sign * kernel[y * size + x];
+	};
+	auto tightestCluster = [&]()
+	{
+		int best = -1;
+		for(int i = 0; i < numCells; ++i)
+			if(pattern[i] && (best < 0 || energy[i] > energy[best]))
+				best = i;
+		return best;
+	};
+	auto largestVoid = [&]()
+	{
+		int best = -1;
+		for(int i = 0; i < numCells; ++i)
+			if(!pattern[i] && (best < 0 || energy[i] < energy[best]))
+				best = i;
+		return best;
+	};
+
+	// Random initial pattern with a fixed seed. std::mt19937 output is the same on all platforms.
+	std::mt19937 random(1);
+	int numInitial = 0;
+	while(numInitial < numCells / 10)
+	{
+		const int cell = random() % numCells;
+		if(!pattern[cell])
+		{
+			set(cell, true);
+			++numInitial;
+		}
+	}
+
+	// Spread it out evenly:
+	for(;;)
+	{
+		const int cluster = tightestCluster();
+		set(cluster, false);
+		const int largest = largestVoid();
+		set(largest, true);
+		if(largest == cluster)
+			break;
+	}
+
+	std::vector<int> ranks(numCells);
+	const std::vector<char> initialPattern = pattern;
+	const std::vector<float> initialEnergy = energy;
+
+	// Phase 1: Remove tightest clusters from the initial pattern
+	for(int rank = numInitial - 1; rank >= 0; --rank)
+	{
+		const int cluster = tightestCluster();
+		set(cluster, false);
+		ranks[cluster] = rank;
+	}
+
+	// Phases 2 and 3: Fill largest voids, starting from the initial pattern again
+	pattern = initialPattern;
+	energy = initialEnergy;
+	for(int rank = numInitial; rank < numCells; ++rank)
+	{
+		const int largest = largestVoid();
+		set(largest, true);
+		ranks[largest] = rank;
+	}
+
+	return ranks;
+}
+
+const ThresholdMap& ThresholdMap::Bayer4()
+{
+	static const ThresholdMap map(4, BayerRanks(4));
+	return map;
+}
+
+const ThresholdMap& ThresholdMap::Bayer8()
+{
+	static const ThresholdMap map(8, BayerRanks(8));
+	return map;
+}
+
+const ThresholdMap& ThresholdMap::BlueNoise()
+{
+	static const ThresholdMap map(64, VoidAndClusterRanks(64));
+	return map;
+}
+
+void OrderedDither(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, const ThresholdMap& map, uint8_t* indices, int numThreads)
+{
+	const size_t rowSize = static_cast<size_t>(width) * channels;
+	const int numBands = (height + kRowsPerBand - 1) / kRowsPerBand;
+	ParallelFor(0, numBands, numThreads, [&](int band)
+	{
+		// Offset pixels go into a row buffer, then the whole row is looked up at once:
+		std::vector<uint8_t> offsetRow(width * 3);
+		const int end = std::min(band * kRowsPerBand + kRowsPerBand, height);
+		for(int y = band * kRowsPerBand; y < end; ++y)
+		{
+			const uint8_t* row = image + y * rowSize;
+			for(int x = 0; x < width; ++x)
+			{
+				const int offset = map.GetOffset(x, y);
+				for(int c = 0; c < 3; ++c)
+					offsetRow[x * 3 + c] = std::min(std::max(row[x * channels + c] + offset, 0), 255);
+			}
+			lookup.FindClosest(offsetRow.data(), 3, width, indices + static_cast<size_t>(y) * width);
+		}
+	});
+}
@@ -0,0 +1,43 @@
+#ifndef ORDEREDDITHER_H
+#define ORDEREDDITHER_H
+
+#include <cstdint>
+#include <vector>
+
+class PaletteLookup;
+
+/// Tileable threshold map for ordered dithering
+/** Holds one signed offset per map cell, which is added to all color components of the pixels on that cell. */
+class ThresholdMap
+{
+public:
+	/// 4x4 Bayer matrix
+	static const ThresholdMap& Bayer4();
+
+	/// 8x8 Bayer matrix
+	static const ThresholdMap& Bayer8();
+
+	/// 64x64 blue noise mask, generated with the void-and-cluster method on first use
+	/** Generation is deterministic, so the mask is the same on every run. */
+	static const ThresholdMap& BlueNoise();
+
+	int GetSize() const {return mSize;}
+
+	/// Offset for pixel x, y. The map is repeated over the whole image.
+	int GetOffset(int x, int y) const {return mOffsets[(y & (mSize - 1)) * mSize + (x & (mSize - 1))];}
+
+private:
+	/// @param ranks Order in which the cells switch on, each of 0..size * size - 1 exactly once.
+	ThresholdMap(int size, const std::vector<int>& ranks);
+
+	const int mSize;
+	std::vector<int8_t> mOffsets;
+};
+
+/// Dither a whole interleaved 8 bit image with a threshold map
+/** Every pixel is independent of all others, so rows are simply split among threads.
+	@param channels Bytes per source pixel. Only the first three are used.
+	@param numThreads 0 uses all hardware threads. */
+void OrderedDither(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, const ThresholdMap& map, uint8_t* indices, int numThreads = 1);
+
+#endif // ORDEREDDITHER_H
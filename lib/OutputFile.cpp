@@ -0,0 +1,71 @@
+#include "OutputFile.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+static bool HaveSameContents(const std::string& fileName1, const std::string& fileName2)
+{
+	std::error_code error1, error2;
+	const auto size1 = std::filesystem::file_size(fileName1, error1);
+	const auto size2 = std::filesystem::file_size(fileName2, error2);
+	if(error1 || error2 || size1 != size2)
+		return false;
+
+	std::ifstream file1(fileName1, std::ios::binary);
+	std::ifstream file2(fileName2, std::ios::binary);
+	char buffer1[65536];
+	char buffer2[65536];
+	while(file1 && file2)
+	{
+		file1.read(buffer1, sizeof(buffer1));
+		file2.read(buffer2, sizeof(buffer2));
+		if(file1.gcount() != file2.gcount() || !std::equal(buffer1, buffer1 + file1.gcount(), buffer2))
+			return false;
+	}
+	return file1.eof() && file2.eof();
+}
+
+OutputFile::OutputFile(const std::string& fileName, bool keepUnchanged) :
+	mFileName(fileName),
+	mPath(fileName)
+{
+	if(keepUnchanged)
+	{
+		// Random name, so that several tools writing the same output don't mix their data:
+		std::random_device random;
+		mPath = fileName + ".tmp" + std::to_string(random()) + std::to_string(random());
+	}
+}
+
+OutputFile::~OutputFile()
+{
+	if(!mCommitted && mPath != mFileName)
+	{
+		std::error_code error;
+		std::filesystem::remove(mPath, error);
+	}
+}
+
+bool OutputFile::Commit()
+{
+	mCommitted = true;
+	if(mPath == mFileName)
+		return true;
+
+	if(HaveSameContents(mPath, mFileName))
+	{
+		std::filesystem::remove(mPath);
+		return false;
+	}
+	std::error_code error;
+	std::filesystem::rename(mPath, mFileName, error);
+	if(error)
+	{
+		std::filesystem::remove(mPath, error);
+		throw std::runtime_error("Could not replace " + mFileName);
+	}
+	return true;
+}
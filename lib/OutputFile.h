@@ -0,0 +1,35 @@
+#ifndef OUTPUTFILE_H
+#define OUTPUTFILE_H
+
+#include <string>
+
+/// Output file that can be left alone when its contents don't change
+/** If keepUnchanged is set, GetPath() is a temporary file next to the output. Commit() replaces the output with it
+	only if the bytes differ, so the modification time of an unchanged output stays the same and the build steps
+	that depend on it don't run again. Otherwise GetPath() is the output itself. */
+class OutputFile
+{
+public:
+	OutputFile(const std::string& fileName, bool keepUnchanged);
+
+	/// Removes the temporary file if Commit() wasn't called
+	~OutputFile();
+
+	OutputFile(const OutputFile&) = delete;
+	OutputFile& operator=(const OutputFile&) = delete;
+
+	/// Where to write the contents
+	const std::string& GetPath() const {return mPath;}
+
+	/// Move the contents into place
+	/** Call after the file at GetPath() is closed.
+		@return false if the output was left unchanged. */
+	bool Commit();
+
+private:
+	std::string mFileName;
+	std::string mPath;
+	bool mCommitted = false;
+};
+
+#endif // OUTPUTFILE_H
@@ -24,61 +24,21 @@ SOFTWARE.
 */
 
 #include "PaletteImage.h"
+#include "BufferPool.h"
+#include "ColorCache.h"
+#include "ErrorDiffusion.h"
+#include "OrderedDither.h"
+#include "PaletteKernel.h"
+#include "PaletteLookup.h"
+#include "Parallel.h"
+#include "Transparency.h"
 
-#include <cmath>
 #include <algorithm>
+#include <limits>
+#include <stdexcept>
 
-struct RGB
-{
-	int r, g, b;
-
-	RGB operator-(const RGB& other) const
-	{
-		return { r - other.r, g - other.g, b - other.b };
-	}
-
-	RGB operator+(const RGB& other) const
-	{
-		return { r + other.r, g + other.g, b + other.b };
-	}
-
-	RGB operator*(double factor) const
-	{
-		return { static_cast<int>(r * factor),
-					static_cast<int>(g * factor),
-					static_cast<int>(b * factor) };
-	}
-
-	void Clip()
-	{
-		r = std::clamp(r, 0, 255);
-		g = std::clamp(g, 0, 255);
-		b = std::clamp(b, 0, 255);
-	}
-};
-
-static double Distance(const RGB& a, const RGB& b)
-{
-	return sqrt((a.r - b.r) * (a.r - b.r) +
-				(a.g - b.g) * (a.g - b.g) +
-				(a.b - b.b) * (a.b - b.b));
-}
-
-static uint8_t FindClosestPaletteColor(const RGB& color, const std::vector<RGB>& palette)
-{
-	double minDist = 1e9;
-	uint8_t index = 0;
-	for (int i = 0; i < palette.size(); i++)
-	{
-		double dist = Distance(color, palette[i]);
-		if (dist < minDist)
-		{
-			minDist = dist;
-			index = i;
-		}
-	}
-	return index;
-}
+/// Below this, a vectorized brute-force search is faster than building a PaletteLookup first
+static constexpr int kMinPixelsForLookup = 256 * 1024;
 
 uint8_t FindClosestPaletteColor(const uint8_t rgbPixel[3], const uint8_t* palette, size_t paletteSize)
 {
@@ -107,66 +67,160 @@ uint8_t FindClosestPaletteColor(const uint8_t rgbPixel[3], const uint8_t* palett
 	return (uint8_t) closestIndex;
 }
 
-std::vector<uint8_t> ConvertToIndexed(const std::vector<RGB>& image, int width, int height, const std::vector<RGB>& palette, bool dither)
+bool KeepsExactColors(DitherMode mode)
 {
-	std::vector<uint8_t> indexedImage(width * height, 0);
+	// Error diffusion has no error to spread on exact colors, ordered dithering adds its offsets anyway:
+	return mode != DitherMode::BAYER4 && mode != DitherMode::BAYER8 && mode != DitherMode::BLUE_NOISE;
+}
 
-	if(dither)
+DitherMode ParseDitherMode(const std::string& name)
+{
+	if(name == "none")
+		return DitherMode::NONE;
+	else if(name == "floyd-steinberg")
+		return DitherMode::FLOYD_STEINBERG;
+	else if(name == "atkinson")
+		return DitherMode::ATKINSON;
+	else if(name == "sierra")
+		return DitherMode::SIERRA;
+	else if(name == "jarvis")
+		return DitherMode::JARVIS_JUDICE_NINKE;
+	else if(name == "bayer4")
+		return DitherMode::BAYER4;
+	else if(name == "bayer8")
+		return DitherMode::BAYER8;
+	else if(name == "blue-noise")
+		return DitherMode::BLUE_NOISE;
+	else
+		throw std::runtime_error("Unknown dither mode \"" + name + "\"");
+}
+
+/// Split rows into one band per thread and call func(begin, end) with the pixel range of each band
+template<class Func>
+static void ForEachBand(int width, int height, int numThreads, Func func)
+{
+	const int numBands = std::max(std::min(ResolveThreadCount(numThreads), height), 1);
+	ParallelFor(0, numBands, numBands, [&](int band)
 	{
-		std::vector<RGB> ditheredImage = image;
+		const size_t begin = static_cast<size_t>(height) * band / numBands * width;
+		const size_t end = static_cast<size_t>(height) * (band + 1) / numBands * width;
+		func(begin, end);
+	});
+}
+
+/// Quantize interleaved pixels with channels bytes each. With 4 channels, the fourth is alpha.
+static std::vector<uint8_t> Quantize(const uint8_t* image, int width, int height, int channels, const PaletteLookup& lookup, const ConversionOptions& options)
+{
+	const size_t numPixels = static_cast<size_t>(width) * height;
+	std::vector<uint8_t> indexedImage = options.bufferPool ? options.bufferPool->AcquireBytes(numPixels) : std::vector<uint8_t>(numPixels);
 
-		for (int y = 0; y < height; y++)
+	// Transparency and other overrides, applied to each range right after its palette search:
+	auto finish = [&](size_t begin, size_t end)
+	{
+		if(channels == 4)
+			SetTransparency(image + begin * 4, end - begin, indexedImage.data() + begin);
+		if(options.finishPixels)
+			options.finishPixels(begin, end, indexedImage.data());
+	};
+
+	switch(options.dither)
+	{
+	case DitherMode::FLOYD_STEINBERG:
+		DiffuseError(image, width, height, channels, lookup, DiffusionKernel::FLOYD_STEINBERG, options.serpentine, options.precision, indexedImage.data(), options.numThreads);
+		break;
+	case DitherMode::ATKINSON:
+		DiffuseError(image, width, height, channels, lookup, DiffusionKernel::ATKINSON, options.serpentine, options.precision, indexedImage.data(), options.numThreads);
+		break;
+	case DitherMode::SIERRA:
+		DiffuseError(image, width, height, channels, lookup, DiffusionKernel::SIERRA, options.serpentine, options.precision, indexedImage.data(), options.numThreads);
+		break;
+	case DitherMode::JARVIS_JUDICE_NINKE:
+		DiffuseError(image, width, height, channels, lookup, DiffusionKernel::JARVIS_JUDICE_NINKE, options.serpentine, options.precision, indexedImage.data(), options.numThreads);
+		break;
+	case DitherMode::BAYER4:
+		OrderedDither(image, width, height, channels, lookup, ThresholdMap::Bayer4(), indexedImage.data(), options.numThreads);
+		break;
+	case DitherMode::BAYER8:
+		OrderedDither(image, width, height, channels, lookup, ThresholdMap::Bayer8(), indexedImage.data(), options.numThreads);
+		break;
+	case DitherMode::BLUE_NOISE:
+		OrderedDither(image, width, height, channels, lookup, ThresholdMap::BlueNoise(), indexedImage.data(), options.numThreads);
+		break;
+	case DitherMode::NONE:
+	{
+		// Images with few colors only need one palette search per color:
+		ColorCache localCache;
+		ColorCache& cache = options.colorCache ? *options.colorCache : localCache;
+		const bool fewColors = cache.Collect(image, channels, indexedImage.size());
+		cache.Resolve(lookup);
+
+		// Pixels are independent, so just split the image into bands of rows:
+		ForEachBand(width, height, options.numThreads, [&](size_t begin, size_t end)
 		{
-			for (int x = 0; x < width; x++)
-			{
-				RGB oldColor = ditheredImage[y * width + x];
-				int paletteIndex = FindClosestPaletteColor(oldColor, palette);
-				RGB newColor = palette[paletteIndex];
-				indexedImage[y * width + x] = paletteIndex;
-
-				RGB error = oldColor - newColor;
-
-				if (x + 1 < width)
-				{
-					ditheredImage[y * width + (x + 1)] = ditheredImage[y * width + (x + 1)] + error * (7.0 / 16.0);
-					ditheredImage[y * width + (x + 1)].Clip();
-				}
-				if (y + 1 < height)
-				{
-					if (x > 0)
-					{
-						ditheredImage[(y + 1) * width + (x - 1)] = ditheredImage[(y + 1) * width + (x - 1)] + error * (3.0 / 16.0);
-						ditheredImage[(y + 1) * width + (x - 1)].Clip();
-					}
-					ditheredImage[(y + 1) * width + x] = ditheredImage[(y + 1) * width + x] + error * (5.0 / 16.0);
-					ditheredImage[(y + 1) * width + x].Clip();
-					if (x + 1 < width)
-					{
-						ditheredImage[(y + 1) * width + (x + 1)] = ditheredImage[(y + 1) * width + (x + 1)] + error * (1.0 / 16.0);
-						ditheredImage[(y + 1) * width + (x + 1)].Clip();
-					}
-				}
-			}
-		}
+			// Whatever the cache does not have is searched in the palette:
+			size_t cached = begin;
+			if(fewColors)
+				cached += cache.Get(image + begin * channels, channels, end - begin, indexedImage.data() + begin);
+			lookup.FindClosest(image + cached * channels, channels, end - cached, indexedImage.data() + cached);
+			finish(begin, end);
+		});
+		return indexedImage;
 	}
-	else
-	{
-		for(size_t i = 0; i < image.size(); ++i)
-			indexedImage[i] = FindClosestPaletteColor(image[i], palette);
 	}
 
+	// Dithering reads pixels of neighbouring rows, so overrides can only follow once all are done:
+	if(channels == 4 || options.finishPixels)
+		ForEachBand(width, height, options.numThreads, finish);
 	return indexedImage;
 }
 
-std::vector<uint8_t> ConvertToIndexed(const uint8_t* image, int width, int height, const uint8_t* palette, bool dither)
+/// Quantize interleaved pixels against the first 224 colors of a palette
+static std::vector<uint8_t> Quantize(const uint8_t* image, int width, int height, int channels, const uint8_t* palette, DitherMode dither, ColorMetric metric)
+{
+	const size_t numColors = 224; // Don't use fire and full-bright colors
+
+	// Building a lookup only pays off for larger images:
+	if(metric == ColorMetric::RGB && dither == DitherMode::NONE && width * height < kMinPixelsForLookup)
+	{
+		std::vector<uint8_t> indexedImage(width * height);
+		const PaletteKernel kernel(palette, numColors);
+		ColorCache cache;
+		size_t cached = 0;
+		if(cache.Collect(image, channels, indexedImage.size()))
+		{
+			cache.Resolve(kernel);
+			cached = cache.Get(image, channels, indexedImage.size(), indexedImage.data());
+		}
+		kernel.FindClosest(image + cached * channels, channels, indexedImage.size() - cached, indexedImage.data() + cached);
+		if(channels == 4)
+			SetTransparency(image, indexedImage.size(), indexedImage.data());
+		return indexedImage;
+	}
+
+	const PaletteLookup lookup(palette, numColors, metric);
+	ConversionOptions options;
+	options.dither = dither;
+	return Quantize(image, width, height, channels, lookup, options);
+}
+
+std::vector<uint8_t> ConvertToIndexed(const uint8_t* image, int width, int height, const PaletteLookup& lookup, const ConversionOptions& options)
+{
+	return Quantize(image, width, height, 3, lookup, options);
+}
+
+std::vector<uint8_t> ConvertToIndexed(const uint8_t* image, int width, int height, const uint8_t* palette, DitherMode dither, ColorMetric metric)
+{
+	return Quantize(image, width, height, 3, palette, dither, metric);
+}
+
+std::vector<uint8_t> ConvertRgbaToIndexed(const uint8_t* image, int width, int height, const PaletteLookup& lookup, const ConversionOptions& options)
+{
+	return Quantize(image, width, height, 4, lookup, options);
+}
+
+std::vector<uint8_t> ConvertRgbaToIndexed(const uint8_t* image, int width, int height, const uint8_t* palette, DitherMode dither, ColorMetric metric)
 {
-	std::vector<RGB> rgbImage(width * height);
-	for(int i = 0; i < width * height; ++i)
-		rgbImage[i] = RGB{image[3*i], image[3*i + 1], image[3*i + 2]};
-	std::vector<RGB> rgbPalette(224); // Don't use fire and full-bright colors
-	for(int i = 0; i < 224; ++i)
-		rgbPalette[i] = RGB{palette[3*i], palette[3*i + 1], palette[3*i + 2]};
-	return ConvertToIndexed(rgbImage, width, height, rgbPalette, dither);
+	return Quantize(image, width, height, 4, palette, dither, metric);
 }
 
 std::vector<uint8_t> ConvertToRgb(const uint8_t* indexed, int width, int height, const uint8_t* palette)
@@ -26,14 +26,96 @@ SOFTWARE.
 #ifndef PALETTEIMAGE_H
 #define PALETTEIMAGE_H
 
+#include "ErrorDiffusion.h"
+#include "PaletteLookup.h"
+
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <string>
 #include <vector>
 
+class BufferPool;
+class ColorCache;
+
+/// How to spread the quantization error
+enum class DitherMode
+{
+	/// Closest color for every pixel
+	NONE,
+
+	/// Error diffusion. Best quality, but the rows depend on each other.
+	FLOYD_STEINBERG,
+
+	/// Error diffusion over three rows, but only 3/4 of the error. More contrast, less noise.
+	ATKINSON,
+
+	/// Error diffusion over three rows. Smoother than Floyd–Steinberg, but slower.
+	SIERRA,
+
+	/// Error diffusion over three rows with the Jarvis, Judice and Ninke kernel
+	JARVIS_JUDICE_NINKE,
+
+	/// Ordered dithering with a 4x4 Bayer matrix
+	BAYER4,
+
+	/// Ordered dithering with an 8x8 Bayer matrix
+	BAYER8,
+
+	/// Ordered dithering with a 64x64 blue noise mask. Less regular patterns than Bayer.
+	BLUE_NOISE
+};
+
+/// True for modes that leave pixels alone that exactly match a palette color
+/** Images that only use palette colors can skip quantization entirely with these. */
+bool KeepsExactColors(DitherMode mode);
+
+/// Dither mode from command line name: none, floyd-steinberg, atkinson, sierra, jarvis, bayer4, bayer8 or blue-noise
+DitherMode ParseDitherMode(const std::string& name);
+
+/// Options for ConvertToIndexed
+struct ConversionOptions
+{
+	DitherMode dither = DitherMode::FLOYD_STEINBERG;
+	DiffusionPrecision precision = DiffusionPrecision::REFERENCE;
+
+	/// Scan every other row from right to left with error diffusion. Always single-threaded.
+	bool serpentine = false;
+
+	/// Cache for images with few unique colors without dithering, shared by all conversions with the same lookup
+	/** If nullptr, each conversion uses its own. */
+	ColorCache* colorCache = nullptr;
+
+	/// Number of threads, 0 uses all hardware threads
+	/** The output does not depend on this. */
+	int numThreads = 1;
+
+	/// Take the indexed image from this pool instead of allocating it. Give it back there when done.
+	BufferPool* bufferPool = nullptr;
+
+	/// Called on ranges of pixels [begin, end) right after they are quantized, e.g. to override some of them
+	/** Runs while the pixels are still in cache, possibly on several threads at once for different ranges.
+		indices points to the whole output image. */
+	std::function<void(size_t begin, size_t end, uint8_t* indices)> finishPixels;
+};
+
 uint8_t FindClosestPaletteColor(const uint8_t rgbPixel[3], const uint8_t* palette, size_t paletteSize);
 
 /// Convert RGB image to indexed image with given palette
-std::vector<uint8_t> ConvertToIndexed(const uint8_t* image, int width, int height, const uint8_t* palette, bool dither = true);
+/** Only the first 224 colors are used. Fire and fullbright colors are left out. */
+std::vector<uint8_t> ConvertToIndexed(const uint8_t* image, int width, int height, const uint8_t* palette, DitherMode dither = DitherMode::FLOYD_STEINBERG,
+									  ColorMetric metric = ColorMetric::RGB);
+
+/// Convert RGB image to indexed image with a prebuilt palette lookup
+std::vector<uint8_t> ConvertToIndexed(const uint8_t* image, int width, int height, const PaletteLookup& lookup, const ConversionOptions& options = ConversionOptions());
+
+/// Convert interleaved RGBA image to indexed image, pixels with alpha below 50% become index 255
+/** Reads the RGBA data in place. Transparency is set in the same pass as the palette search. */
+std::vector<uint8_t> ConvertRgbaToIndexed(const uint8_t* image, int width, int height, const uint8_t* palette, DitherMode dither = DitherMode::FLOYD_STEINBERG,
+										  ColorMetric metric = ColorMetric::RGB);
+
+/// Convert interleaved RGBA image to indexed image with a prebuilt palette lookup, see above
+std::vector<uint8_t> ConvertRgbaToIndexed(const uint8_t* image, int width, int height, const PaletteLookup& lookup, const ConversionOptions& options = ConversionOptions());
 
 /// Convert indexed image to RGB image with given palette
 std::vector<uint8_t> ConvertToRgb(const uint8_t* indexed, int width, int height, const uint8_t* palette);
@@ -0,0 +1,267 @@
+#include "PaletteKernel.h"
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PALETTEKERNEL_X86
+#include <immintrin.h>
+#endif
+
+/// Value of padding entries, far away from any 8 bit color
+static constexpr int16_t kPadding = 1024;
+
+using KernelFunction = void (*)(const int16_t* r, const int16_t* g, const int16_t* b, size_t paletteSize, const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices);
+
+static void FindClosestScalar(const int16_t* r, const int16_t* g, const int16_t* b, size_t paletteSize, const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices)
+{
+	for(size_t p = 0; p < count; ++p)
+	{
+		const uint8_t* pixel = pixels + p * pixelStride;
+		int closestDistance = INT_MAX;
+		size_t closestIndex = 0;
+		for(size_t i = 0; i < paletteSize; ++i)
+		{
+			const int dr = pixel[0] - r[i];
+			const int dg = pixel[1] - g[i];
+			const int db = pixel[2] - b[i];
+			const int distance = dr * dr + dg * dg + db * db;
+			if(distance < closestDistance)
+			{
+				closestDistance = distance;
+				closestIndex = i;
+			}
+		}
+		indices[p] = closestIndex;
+	}
+}
+
+#ifdef PALETTEKERNEL_X86
+
+/// Pick the lowest index among the lanes with the lowest distance
+static uint8_t ReduceLanes(const int32_t* distances, const int32_t* indices, size_t numLanes)
+{
+	int32_t closestDistance = INT_MAX;
+	int32_t closestIndex = 0;
+	for(size_t i = 0; i < numLanes; ++i)
+	{
+		if(distances[i] < closestDistance || (distances[i] == closestDistance && indices[i] < closestIndex))
+		{
+			closestDistance = distances[i];
+			closestIndex = indices[i];
+		}
+	}
+	return closestIndex;
+}
+
+/* All kernels below square the int16 differences with madd after interleaving them pairwise. Unpacking works
+	within 128 bit lanes, so the entry index of each 32 bit lane is tracked explicitly. Each lane only ever
+	replaces its best entry by a strictly closer one, and sees its entries in ascending order, so the lowest
+	index wins ties like in the scalar search. */
+
+__attribute__((target("sse2")))
+static void FindClosestSse2(const int16_t* r, const int16_t* g, const int16_t* b, size_t paletteSize, const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i step = _mm_set1_epi32(8);
+	for(size_t p = 0; p < count; ++p)
+	{
+		const uint8_t* pixel = pixels + p * pixelStride;
+		const __m128i pr = _mm_set1_epi16(pixel[0]);
+		const __m128i pg = _mm_set1_epi16(pixel[1]);
+		const __m128i pb = _mm_set1_epi16(pixel[2]);
+
+		__m128i bestLo = _mm_set1_epi32(INT_MAX), bestHi = bestLo;
+		__m128i bestIndexLo = zero, bestIndexHi = zero;
+		__m128i indexLo = _mm_setr_epi32(0, 1, 2, 3);
+		__m128i indexHi = _mm_setr_epi32(4, 5, 6, 7);
+		for(size_t i = 0; i < paletteSize; i += 8)
+		{
+			const __m128i dr = _mm_sub_epi16(pr, _mm_load_si128(reinterpret_cast<const __m128i*>(r + i)));
+			const __m128i dg = _mm_sub_epi16(pg, _mm_load_si128(reinterpret_cast<const __m128i*>(g + i)));
+			const __m128i db = _mm_sub_epi16(pb, _mm_load_si128(reinterpret_cast<const __m128i*>(b + i)));
+			const __m128i rgLo = _mm_unpacklo_epi16(dr, dg);
+			const __m128i rgHi = _mm_unpackhi_epi16(dr, dg);
+			const __m128i bLo = _mm_unpacklo_epi16(db, zero);
+			const __m128i bHi = _mm_unpackhi_epi16(db, zero);
+			const __m128i distLo = _mm_add_epi32(_mm_madd_epi16(rgLo, rgLo), _mm_madd_epi16(bLo, bLo));
+			const __m128i distHi = _mm_add_epi32(_mm_madd_epi16(rgHi, rgHi), _mm_madd_epi16(bHi, bHi));
+
+			const __m128i closerLo = _mm_cmplt_epi32(distLo, bestLo);
+			const __m128i closerHi = _mm_cmplt_epi32(distHi, bestHi);
+			bestLo = _mm_or_si128(_mm_and_si128(closerLo, distLo), _mm_andnot_si128(closerLo, bestLo));
+			bestHi = _mm_or_si128(_mm_and_si128(closerHi, distHi), _mm_andnot_si128(closerHi, bestHi));
+			bestIndexLo = _mm_or_si128(_mm_and_si128(closerLo, indexLo), _mm_andnot_si128(closerLo, bestIndexLo));
+			bestIndexHi = _mm_or_si128(_mm_and_si128(closerHi, indexHi), _mm_andnot_si128(closerHi, bestIndexHi));
+			indexLo = _mm_add_epi32(indexLo, step);
+			indexHi = _mm_add_epi32(indexHi, step);
+		}
+
+		alignas(16) int32_t distances[8];
+		alignas(16) int32_t laneIndices[8];
+		_mm_store_si128(reinterpret_cast<__m128i*>(distances), bestLo);
+		_mm_store_si128(reinterpret_cast<__m128i*>(distances + 4), bestHi);
+		_mm_store_si128(reinterpret_cast<__m128i*>(laneIndices), bestIndexLo);
+		_mm_store_si128(reinterpret_cast<__m128i*>(laneIndices + 4), bestIndexHi);
+		indices[p] = ReduceLanes(distances, laneIndices, 8);
+	}
+}
+
+__attribute__((target("avx2")))
+static void FindClosestAvx2(const int16_t* r, const int16_t* g, const int16_t* b, size_t paletteSize, const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i step = _mm256_set1_epi32(16);
+	for(size_t p = 0; p < count; ++p)
+	{
+		const uint8_t* pixel = pixels + p * pixelStride;
+		const __m256i pr = _mm256_set1_epi16(pixel[0]);
+		const __m256i pg = _mm256_set1_epi16(pixel[1]);
+		const __m256i pb = _mm256_set1_epi16(pixel[2]);
+
+		__m256i bestLo = _mm256_set1_epi32(INT_MAX), bestHi = bestLo;
+		__m256i bestIndexLo = zero, bestIndexHi = zero;
+		__m256i indexLo = _mm256_setr_epi32(0, 1, 2, 3, 8, 9, 10, 11);
+		__m256i indexHi = _mm256_setr_epi32(4, 5, 6, 7, 12, 13, 14, 15);
+		for(size_t i = 0; i < paletteSize; i += 16)
+		{
+			const __m256i dr = _mm256_sub_epi16(pr, _mm256_load_si256(reinterpret_cast<const __m256i*>(r + i)));
+			const __m256i dg = _mm256_sub_epi16(pg, _mm256_load_si256(reinterpret_cast<const __m256i*>(g + i)));
+			const __m256i db = _mm256_sub_epi16(pb, _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i)));
+			const __m256i rgLo = _mm256_unpacklo_epi16(dr, dg);
+			const __m256i rgHi = _mm256_unpackhi_epi16(dr, dg);
+			const __m256i bLo = _mm256_unpacklo_epi16(db, zero);
+			const __m256i bHi = _mm256_unpackhi_epi16(db, zero);
+			const __m256i distLo = _mm256_add_epi32(_mm256_madd_epi16(rgLo, rgLo), _mm256_madd_epi16(bLo, bLo));
+			const __m256i distHi = _mm256_add_epi32(_mm256_madd_epi16(rgHi, rgHi), _mm256_madd_epi16(bHi, bHi));
+
+			const __m256i closerLo = _mm256_cmpgt_epi32(bestLo, distLo);
+			const __m256i closerHi = _mm256_cmpgt_epi32(bestHi, distHi);
+			bestLo = _mm256_min_epi32(bestLo, distLo);
+			bestHi = _mm256_min_epi32(bestHi, distHi);
+			bestIndexLo = _mm256_blendv_epi8(bestIndexLo, indexLo, closerLo);
+			bestIndexHi = _mm256_blendv_epi8(bestIndexHi, indexHi, closerHi);
+			indexLo = _mm256_add_epi32(indexLo, step);
+			indexHi = _mm256_add_epi32(indexHi, step);
+		}
+
+		alignas(32) int32_t distances[16];
+		alignas(32) int32_t laneIndices[16];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(distances), bestLo);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(distances + 8), bestHi);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(laneIndices), bestIndexLo);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(laneIndices + 8), bestIndexHi);
+		indices[p] = ReduceLanes(distances, laneIndices, 16);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void FindClosestAvx512(const int16_t* r, const int16_t* g, const int16_t* b, size_t paletteSize, const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i step = _mm512_set1_epi32(32);
+	for(size_t p = 0; p < count; ++p)
+	{
+		const uint8_t* pixel = pixels + p * pixelStride;
+		const __m512i pr = _mm512_set1_epi16(pixel[0]);
+		const __m512i pg = _mm512_set1_epi16(pixel[1]);
+		const __m512i pb = _mm512_set1_epi16(pixel[2]);
+
+		__m512i bestLo = _mm512_set1_epi32(INT_MAX), bestHi = bestLo;
+		__m512i bestIndexLo = zero, bestIndexHi = zero;
+		__m512i indexLo = _mm512_setr_epi32(0, 1, 2, 3, 8, 9, 10, 11, 16, 17, 18, 19, 24, 25, 26, 27);
+		__m512i indexHi = _mm512_setr_epi32(4, 5, 6, 7, 12, 13, 14, 15, 20, 21, 22, 23, 28, 29, 30, 31);
+		for(size_t i = 0; i < paletteSize; i += 32)
+		{
+			const __m512i dr = _mm512_sub_epi16(pr, _mm512_load_si512(r + i));
+			const __m512i dg = _mm512_sub_epi16(pg, _mm512_load_si512(g + i));
+			const __m512i db = _mm512_sub_epi16(pb, _mm512_load_si512(b + i));
+			const __m512i rgLo = _mm512_unpacklo_epi16(dr, dg);
+			const __m512i rgHi = _mm512_unpackhi_epi16(dr, dg);
+			const __m512i bLo = _mm512_unpacklo_epi16(db, zero);
+			const __m512i bHi = _mm512_unpackhi_epi16(db, zero);
+			const __m512i distLo = _mm512_add_epi32(_mm512_madd_epi16(rgLo, rgLo), _mm512_madd_epi16(bLo, bLo));
+			const __m512i distHi = _mm512_add_epi32(_mm512_madd_epi16(rgHi, rgHi), _mm512_madd_epi16(bHi, bHi));
+
+			const __mmask16 closerLo = _mm512_cmplt_epi32_mask(distLo, bestLo);
+			const __mmask16 closerHi = _mm512_cmplt_epi32_mask(distHi, bestHi);
+			bestLo = _mm512_min_epi32(bestLo, distLo);
+			bestHi = _mm512_min_epi32(bestHi, distHi);
+			bestIndexLo = _mm512_mask_mov_epi32(bestIndexLo, closerLo, indexLo);
+			bestIndexHi = _mm512_mask_mov_epi32(bestIndexHi, closerHi, indexHi);
+			indexLo = _mm512_add_epi32(indexLo, step);
+			indexHi = _mm512_add_epi32(indexHi, step);
+		}
+
+		const __m512i closest = _mm512_set1_epi32(_mm512_reduce_min_epi32(_mm512_min_epi32(bestLo, bestHi)));
+		const int32_t indexFromLo = _mm512_mask_reduce_min_epi32(_mm512_cmpeq_epi32_mask(bestLo, closest), bestIndexLo);
+		const int32_t indexFromHi = _mm512_mask_reduce_min_epi32(_mm512_cmpeq_epi32_mask(bestHi, closest), bestIndexHi);
+		indices[p] = std::min(indexFromLo, indexFromHi);
+	}
+}
+
+#endif // PALETTEKERNEL_X86
+
+struct KernelSelection
+{
+	KernelFunction function;
+	const char* name;
+};
+
+static KernelSelection SelectKernel()
+{
+#ifdef PALETTEKERNEL_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return {FindClosestAvx512, "AVX-512"};
+	if(__builtin_cpu_supports("avx2"))
+		return {FindClosestAvx2, "AVX2"};
+	if(__builtin_cpu_supports("sse2"))
+		return {FindClosestSse2, "SSE2"};
+#endif
+	return {FindClosestScalar, "scalar"};
+}
+
+static const KernelSelection& GetKernel()
+{
+	static const KernelSelection selection = SelectKernel();
+	return selection;
+}
+
+PaletteKernel::PaletteKernel(const uint8_t* palette, size_t paletteSize)
+{
+	if(paletteSize == 0 || paletteSize > 256)
+		throw std::runtime_error("Palette size must be between 1 and 256");
+
+	mPaddedSize = (paletteSize + kBlockSize - 1) / kBlockSize * kBlockSize;
+	// Extra block for aligning the start to 64 bytes:
+	mComponents.resize(mPaddedSize * 3 + kBlockSize, kPadding);
+	const uintptr_t misalignment = reinterpret_cast<uintptr_t>(mComponents.data()) % (kBlockSize * sizeof(int16_t));
+	mOffset = misalignment ? (kBlockSize * sizeof(int16_t) - misalignment) / sizeof(int16_t) : 0;
+	int16_t* r = mComponents.data() + mOffset;
+	for(size_t i = 0; i < paletteSize; ++i)
+	{
+		r[i] = palette[i * 3];
+		r[i + mPaddedSize] = palette[i * 3 + 1];
+		r[i + 2 * mPaddedSize] = palette[i * 3 + 2];
+	}
+}
+
+uint8_t PaletteKernel::FindClosest(const uint8_t rgb[3]) const
+{
+	uint8_t index;
+	FindClosest(rgb, 3, 1, &index);
+	return index;
+}
+
+void PaletteKernel::FindClosest(const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices) const
+{
+	const int16_t* r = mComponents.data() + mOffset;
+	GetKernel().function(r, r + mPaddedSize, r + 2 * mPaddedSize, mPaddedSize, pixels, pixelStride, count, indices);
+}
+
+const char* PaletteKernel::GetInstructionSet()
+{
+	return GetKernel().name;
+}
@@ -0,0 +1,48 @@
+#ifndef PALETTEKERNEL_H
+#define PALETTEKERNEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Vectorized brute-force nearest color search
+/** The palette is stored as separate int16 arrays for red, green and blue, padded to a multiple of 32 entries.
+	Depending on the CPU, 8 (SSE2), 16 (AVX2) or 32 (AVX-512) entries are compared per instruction. The
+	implementation is selected once at runtime, with a scalar fallback for other architectures. Results are
+	identical to FindClosestPaletteColor(). */
+class PaletteKernel
+{
+public:
+	PaletteKernel(const uint8_t* palette, size_t paletteSize);
+
+	/// A copy would get a new buffer with a different alignment than mOffset was computed for. Moves keep the buffer.
+	PaletteKernel(const PaletteKernel&) = delete;
+	PaletteKernel(PaletteKernel&&) = default;
+
+	PaletteKernel& operator=(const PaletteKernel&) = delete;
+	PaletteKernel& operator=(PaletteKernel&&) = default;
+
+	/// Get index of palette entry closest to the given color
+	uint8_t FindClosest(const uint8_t rgb[3]) const;
+
+	/// Find closest palette entries for many pixels at once
+	/** @param pixels First color component of the first pixel.
+		@param pixelStride Distance between pixels in bytes, e.g. 3 for RGB or 4 for RGBA.
+		@param count Number of pixels.
+		@param indices Output, count entries. */
+	void FindClosest(const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices) const;
+
+	/// Name of the instruction set selected at runtime
+	static const char* GetInstructionSet();
+
+private:
+	/// Palette entries are padded to multiples of this
+	static constexpr size_t kBlockSize = 32;
+
+	/// Red, then green, then blue, each mPaddedSize entries, starting at mOffset
+	std::vector<int16_t> mComponents;
+	size_t mOffset;
+	size_t mPaddedSize;
+};
+
+#endif // PALETTEKERNEL_H
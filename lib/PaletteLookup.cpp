@@ -0,0 +1,286 @@
+#include "PaletteLookup.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+/// 8 bit sRGB component to linear
+static float SrgbToLinear(float value)
+{
+	value /= 255.f;
+	return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+/// Linear RGB to LMS cone response. All coefficients are positive, so this is monotonic in every component.
+static constexpr float kRgbToLms[3][3] = {
+	{0.4122214708f, 0.5363325363f, 0.0514459929f},
+	{0.2119034982f, 0.6806995451f, 0.1073969566f},
+	{0.0883024619f, 0.2817188376f, 0.6299787005f}
+};
+
+/// Nonlinear LMS to OKLab
+static constexpr float kLmsToLab[3][3] = {
+	{0.2104542553f, 0.7936177850f, -0.0040720468f},
+	{1.9779984951f, -2.4285922050f, 0.4505937099f},
+	{0.0259040371f, 0.7827717662f, -0.8086757660f}
+};
+
+/// Linear RGB to nonlinear LMS
+static void LinearToLms(const float rgb[3], float lms[3])
+{
+	for(int i = 0; i < 3; ++i)
+		lms[i] = std::cbrt(kRgbToLms[i][0] * rgb[0] + kRgbToLms[i][1] * rgb[1] + kRgbToLms[i][2] * rgb[2]);
+}
+
+/// Linear RGB to OKLab (Björn Ottosson, 2020)
+static void LinearToOklab(const float rgb[3], float lab[3])
+{
+	float lms[3];
+	LinearToLms(rgb, lms);
+	for(int i = 0; i < 3; ++i)
+		lab[i] = kLmsToLab[i][0] * lms[0] + kLmsToLab[i][1] * lms[1] + kLmsToLab[i][2] * lms[2];
+}
+
+ColorMetric ParseColorMetric(const std::string& name)
+{
+	if(name == "rgb")
+		return ColorMetric::RGB;
+	else if(name == "oklab")
+		return ColorMetric::OKLAB;
+	else
+		throw std::runtime_error("Unknown color metric \"" + name + "\"");
+}
+
+PaletteLookup::PaletteLookup(const uint8_t* palette, size_t paletteSize, ColorMetric metric) :
+	mMetric(metric),
+	mPalette(palette, palette + paletteSize * 3)
+{
+	if(paletteSize == 0 || paletteSize > 256)
+		throw std::runtime_error("Palette size must be between 1 and 256");
+
+	if(metric == ColorMetric::OKLAB)
+		BuildOklabCells();
+	else
+		BuildCells();
+}
+
+void PaletteLookup::BuildCells()
+{
+	const size_t paletteSize = GetSize();
+	const int cellSize = 1 << kCellShift;
+	const int numCells = kCellsPerAxis * kCellsPerAxis * kCellsPerAxis;
+
+	// Squared distance from each palette entry to the nearest and farthest value of each cell, per axis:
+	std::vector<int> nearest[3], farthest[3];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		nearest[axis].resize(kCellsPerAxis * paletteSize);
+		farthest[axis].resize(kCellsPerAxis * paletteSize);
+		for(int c = 0; c < kCellsPerAxis; ++c)
+		{
+			const int lo = c * cellSize;
+			const int hi = lo + cellSize - 1;
+			for(size_t i = 0; i < paletteSize; ++i)
+			{
+				const int value = mPalette[i * 3 + axis];
+				const int n = value < lo ? lo - value : (value > hi ? value - hi : 0);
+				const int f = std::max(std::abs(value - lo), std::abs(value - hi));
+				nearest[axis][c * paletteSize + i] = n * n;
+				farthest[axis][c * paletteSize + i] = f * f;
+			}
+		}
+	}
+
+	mCellOffsets.reserve(numCells + 1);
+	std::vector<int> minDistances(paletteSize);
+	for(int cell = 0; cell < numCells; ++cell)
+	{
+		const int* nr = nearest[0].data() + (cell >> (2 * kCellBits)) * paletteSize;
+		const int* ng = nearest[1].data() + ((cell >> kCellBits) & (kCellsPerAxis - 1)) * paletteSize;
+		const int* nb = nearest[2].data() + (cell & (kCellsPerAxis - 1)) * paletteSize;
+		const int* fr = farthest[0].data() + (cell >> (2 * kCellBits)) * paletteSize;
+		const int* fg = farthest[1].data() + ((cell >> kCellBits) & (kCellsPerAxis - 1)) * paletteSize;
+		const int* fb = farthest[2].data() + (cell & (kCellsPerAxis - 1)) * paletteSize;
+
+		// The closest entry for any color in the cell is at most as far away as the smallest farthest distance:
+		int bound = std::numeric_limits<int>::max();
+		for(size_t i = 0; i < paletteSize; ++i)
+		{
+			minDistances[i] = nr[i] + ng[i] + nb[i];
+			bound = std::min(bound, fr[i] + fg[i] + fb[i]);
+		}
+
+		mCellOffsets.push_back(mCandidates.size());
+		for(size_t i = 0; i < paletteSize; ++i)
+		{
+			if(minDistances[i] <= bound)
+				mCandidates.push_back(i);
+		}
+	}
+	mCellOffsets.push_back(mCandidates.size());
+}
+
+/// OKLab box around all colors with linear RGB values between rgbMin and rgbMax
+/** The RGB bounds are pushed through the monotonic LMS step and then through the last matrix with interval
+	arithmetic. A small margin covers rounding differences to the conversion of single colors. */
+static void OklabBox(const float rgbMin[3], const float rgbMax[3], float labMin[3], float labMax[3])
+{
+	float lmsMin[3], lmsMax[3];
+	LinearToLms(rgbMin, lmsMin);
+	LinearToLms(rgbMax, lmsMax);
+	for(int i = 0; i < 3; ++i)
+	{
+		labMin[i] = labMax[i] = 0;
+		for(int j = 0; j < 3; ++j)
+		{
+			const float coefficient = kLmsToLab[i][j];
+			labMin[i] += coefficient * (coefficient > 0 ? lmsMin[j] : lmsMax[j]);
+			labMax[i] += coefficient * (coefficient > 0 ? lmsMax[j] : lmsMin[j]);
+		}
+		labMin[i] -= 1e-5f;
+		labMax[i] += 1e-5f;
+	}
+}
+
+/// Append the entries of in that can be the closest one to some color in the box to out
+/** Like in PaletteLookup::BuildCells(), these are the entries that are closer to the box than the farthest distance
+	of the best entry. */
+static void FilterCandidates(const std::vector<float>& paletteLab, const float labMin[3], const float labMax[3], const uint8_t* in,
+							 size_t count, std::vector<float>& nearest, std::vector<uint8_t>& out)
+{
+	float bound = std::numeric_limits<float>::max();
+	for(size_t i = 0; i < count; ++i)
+	{
+		const float* color = paletteLab.data() + in[i] * 3;
+		float n = 0, f = 0;
+		for(int c = 0; c < 3; ++c)
+		{
+			const float below = labMin[c] - color[c];
+			const float above = color[c] - labMax[c];
+			const float outside = std::max(std::max(below, above), 0.f);
+			const float inside = std::max(std::abs(below), std::abs(above));
+			n += outside * outside;
+			f += inside * inside;
+		}
+		nearest[i] = n;
+		bound = std::min(bound, f);
+	}
+
+	// Some slack, so rounding can't drop the winner:
+	bound = bound * 1.001f + 1e-7f;
+	for(size_t i = 0; i < count; ++i)
+	{
+		if(nearest[i] <= bound)
+			out.push_back(in[i]);
+	}
+}
+
+/// SrgbToLinear() for all 8 bit values
+static const float* LinearTable()
+{
+	static const std::vector<float> table = []
+	{
+		std::vector<float> values(256);
+		for(int i = 0; i < 256; ++i)
+			values[i] = SrgbToLinear(i);
+		return values;
+	}();
+	return table.data();
+}
+
+void PaletteLookup::BuildOklabCells()
+{
+	const size_t paletteSize = GetSize();
+	const int cellsPerAxis = 1 << kOklabCellBits;
+	const int cellSize = 1 << kOklabCellShift;
+	const int blocksPerAxis = 1 << kBlockBits;
+	const int blockShift = kOklabCellBits - kBlockBits;
+	const float* linear = LinearTable();
+
+	mPaletteLab.resize(paletteSize * 3);
+	for(size_t i = 0; i < paletteSize; ++i)
+	{
+		const uint8_t* color = GetColor(i);
+		const float rgb[3] = {linear[color[0]], linear[color[1]], linear[color[2]]};
+		LinearToOklab(rgb, mPaletteLab.data() + i * 3);
+	}
+
+	// Candidates of blocks of cells first, so that each cell only has to check a few entries:
+	std::vector<uint8_t> allEntries(paletteSize);
+	for(size_t i = 0; i < paletteSize; ++i)
+		allEntries[i] = i;
+	std::vector<float> nearest(paletteSize);
+	std::vector<uint32_t> blockOffsets;
+	std::vector<uint8_t> blockCandidates;
+	const int blockValues = cellSize << blockShift;
+	for(int block = 0; block < blocksPerAxis * blocksPerAxis * blocksPerAxis; ++block)
+	{
+		const int first[3] = {
+			(block >> (2 * kBlockBits)) * blockValues,
+			((block >> kBlockBits) & (blocksPerAxis - 1)) * blockValues,
+			(block & (blocksPerAxis - 1)) * blockValues
+		};
+		const float rgbMin[3] = {linear[first[0]], linear[first[1]], linear[first[2]]};
+		const float rgbMax[3] = {linear[first[0] + blockValues - 1], linear[first[1] + blockValues - 1], linear[first[2] + blockValues - 1]};
+		float labMin[3], labMax[3];
+		OklabBox(rgbMin, rgbMax, labMin, labMax);
+		blockOffsets.push_back(blockCandidates.size());
+		FilterCandidates(mPaletteLab, labMin, labMax, allEntries.data(), paletteSize, nearest, blockCandidates);
+	}
+	blockOffsets.push_back(blockCandidates.size());
+
+	const int numCells = cellsPerAxis * cellsPerAxis * cellsPerAxis;
+	mCellOffsets.reserve(numCells + 1);
+	for(int cell = 0; cell < numCells; ++cell)
+	{
+		const int index[3] = {cell >> (2 * kOklabCellBits), (cell >> kOklabCellBits) & (cellsPerAxis - 1), cell & (cellsPerAxis - 1)};
+		const int block = ((index[0] >> blockShift) << (2 * kBlockBits)) | ((index[1] >> blockShift) << kBlockBits) | (index[2] >> blockShift);
+		const float rgbMin[3] = {linear[index[0] * cellSize], linear[index[1] * cellSize], linear[index[2] * cellSize]};
+		const float rgbMax[3] = {linear[index[0] * cellSize + cellSize - 1], linear[index[1] * cellSize + cellSize - 1], linear[index[2] * cellSize + cellSize - 1]};
+		float labMin[3], labMax[3];
+		OklabBox(rgbMin, rgbMax, labMin, labMax);
+		mCellOffsets.push_back(mCandidates.size());
+		FilterCandidates(mPaletteLab, labMin, labMax, blockCandidates.data() + blockOffsets[block], blockOffsets[block + 1] - blockOffsets[block],
+						 nearest, mCandidates);
+	}
+	mCellOffsets.push_back(mCandidates.size());
+}
+
+uint8_t PaletteLookup::FindClosestOklab(int r, int g, int b) const
+{
+	const uint32_t cell = ((r >> kOklabCellShift) << (2 * kOklabCellBits)) | ((g >> kOklabCellShift) << kOklabCellBits) | (b >> kOklabCellShift);
+	const uint8_t* candidate = mCandidates.data() + mCellOffsets[cell];
+	const uint8_t* end = mCandidates.data() + mCellOffsets[cell + 1];
+	if(end - candidate == 1)
+		return *candidate;
+
+	const float* linear = LinearTable();
+	const float rgb[3] = {linear[r], linear[g], linear[b]};
+	float lab[3];
+	LinearToOklab(rgb, lab);
+
+	uint8_t index = *candidate;
+	float minDistance = std::numeric_limits<float>::max();
+	for(; candidate != end; ++candidate)
+	{
+		const float* color = mPaletteLab.data() + *candidate * 3;
+		const float dl = lab[0] - color[0];
+		const float da = lab[1] - color[1];
+		const float db = lab[2] - color[2];
+		const float distance = dl * dl + da * da + db * db;
+		if(distance < minDistance)
+		{
+			minDistance = distance;
+			index = *candidate;
+		}
+	}
+	return index;
+}
+
+void PaletteLookup::FindClosest(const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices) const
+{
+	for(size_t i = 0; i < count; ++i, pixels += pixelStride)
+		indices[i] = FindClosest(pixels[0], pixels[1], pixels[2]);
+}
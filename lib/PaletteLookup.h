@@ -0,0 +1,107 @@
+#ifndef PALETTELOOKUP_H
+#define PALETTELOOKUP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Distance used to find the closest palette color
+enum class ColorMetric
+{
+	/// Euclidean distance of 8 bit sRGB values
+	RGB,
+
+	/// Euclidean distance in OKLab space. Closer to perceived differences, especially for skin tones and darks.
+	OKLAB
+};
+
+/// Color metric from command line name: rgb or oklab
+ColorMetric ParseColorMetric(const std::string& name);
+
+/// Precomputed nearest color search for a fixed palette
+/** The RGB cube is divided into cells of 8x8x8 colors. For every cell, all palette entries that can be the
+	closest one to any color inside the cell are stored in ascending index order. A lookup only has to check
+	these few candidates, and because no possible winner is ever dropped, the result is exactly the same as a
+	brute-force search over the whole palette, including the tie-breaking towards the lower index.
+
+	With ColorMetric::OKLAB, the palette is converted to OKLab once, and the cells are 4x4x4 colors. Their
+	candidates are found from the OKLab bounding box of all colors in the cell. A lookup converts the color to
+	OKLab and compares it with the candidates, or returns the only candidate right away, which is the case for
+	most cells. The result is the same as a brute-force OKLab search.
+
+	Build once per palette and reuse it for all images. */
+class PaletteLookup
+{
+public:
+	/// Build lookup for the first paletteSize RGB entries of palette
+	PaletteLookup(const uint8_t* palette, size_t paletteSize, ColorMetric metric = ColorMetric::RGB);
+
+	/// Get index of palette entry closest to the given color
+	/** Components must be in the range 0..255. */
+	uint8_t FindClosest(int r, int g, int b) const
+	{
+		if(mMetric == ColorMetric::OKLAB)
+			return FindClosestOklab(r, g, b);
+
+		const uint32_t cell = ((r >> kCellShift) << (2 * kCellBits)) | ((g >> kCellShift) << kCellBits) | (b >> kCellShift);
+		const uint8_t* candidate = mCandidates.data() + mCellOffsets[cell];
+		const uint8_t* end = mCandidates.data() + mCellOffsets[cell + 1];
+
+		uint8_t index = *candidate;
+		int minDistance = Distance(r, g, b, index);
+		for(++candidate; candidate != end; ++candidate)
+		{
+			const int distance = Distance(r, g, b, *candidate);
+			if(distance < minDistance)
+			{
+				minDistance = distance;
+				index = *candidate;
+			}
+		}
+		return index;
+	}
+
+	uint8_t FindClosest(const uint8_t rgb[3]) const {return FindClosest(rgb[0], rgb[1], rgb[2]);}
+
+	/// Find closest palette entries for many pixels at once
+	/** @param pixelStride Distance between pixels in bytes, e.g. 3 for RGB or 4 for RGBA. */
+	void FindClosest(const uint8_t* pixels, size_t pixelStride, size_t count, uint8_t* indices) const;
+
+	/// RGB values of the palette entry with the given index
+	const uint8_t* GetColor(size_t index) const {return mPalette.data() + index * 3;}
+
+	size_t GetSize() const {return mPalette.size() / 3;}
+
+private:
+	static constexpr int kCellBits = 5;
+	static constexpr int kCellShift = 8 - kCellBits;
+	static constexpr int kCellsPerAxis = 1 << kCellBits;
+	static constexpr int kOklabCellBits = 6;
+	static constexpr int kOklabCellShift = 8 - kOklabCellBits;
+	static constexpr int kBlockBits = 4;
+
+	void BuildCells();
+	void BuildOklabCells();
+
+	uint8_t FindClosestOklab(int r, int g, int b) const;
+
+	int Distance(int r, int g, int b, size_t index) const
+	{
+		const uint8_t* color = GetColor(index);
+		const int dr = r - color[0];
+		const int dg = g - color[1];
+		const int db = b - color[2];
+		return dr * dr + dg * dg + db * db;
+	}
+
+	ColorMetric mMetric;
+	std::vector<uint8_t> mPalette;
+	std::vector<uint32_t> mCellOffsets;
+	std::vector<uint8_t> mCandidates;
+
+	/// Palette in OKLab for ColorMetric::OKLAB, empty otherwise
+	std::vector<float> mPaletteLab;
+};
+
+#endif // PALETTELOOKUP_H
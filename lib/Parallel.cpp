@@ -0,0 +1,59 @@
+#include "Parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+int ResolveThreadCount(int numThreads)
+{
+	if(numThreads > 0)
+		return numThreads;
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void ParallelFor(int begin, int end, int numThreads, const std::function<void(int)>& function)
+{
+	const int numWorkers = std::min(ResolveThreadCount(numThreads), end - begin);
+	if(numWorkers <= 1)
+	{
+		for(int i = begin; i < end; ++i)
+			function(i);
+		return;
+	}
+
+	std::atomic<int> nextIndex(begin);
+	std::atomic<bool> failed(false);
+	std::exception_ptr exception;
+	std::mutex exceptionMutex;
+
+	auto worker = [&]()
+	{
+		for(int i = nextIndex++; i < end && !failed; i = nextIndex++)
+		{
+			try
+			{
+				function(i);
+			}
+			catch(...)
+			{
+				std::lock_guard<std::mutex> lock(exceptionMutex);
+				if(!exception)
+					exception = std::current_exception();
+				failed = true;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for(int i = 1; i < numWorkers; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for(auto& thread: threads)
+		thread.join();
+
+	if(exception)
+		std::rethrow_exception(exception);
+}
@@ -0,0 +1,15 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+/// Number of threads to actually use for a requested thread count
+/** 0 means one thread per hardware thread. */
+int ResolveThreadCount(int numThreads);
+
+/// Call function(i) for every i in [begin, end) on up to numThreads threads
+/** Indices are handed out in ascending order, one at a time. Blocks until all calls are done. If a call throws,
+	no further indices are started and the first exception is rethrown on the calling thread. */
+void ParallelFor(int begin, int end, int numThreads, const std::function<void(int)>& function);
+
+#endif // PARALLEL_H
@@ -0,0 +1,92 @@
+#include "QuantizationCache.h"
+
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+static const char kMagic[4] = {'Q', 'C', 'H', 'E'};
+
+QuantizationCache::QuantizationCache(const std::string& directory) :
+	mDirectory(directory)
+{
+	std::error_code error;
+	std::filesystem::create_directories(mDirectory, error);
+	if(!std::filesystem::is_directory(mDirectory))
+		throw std::runtime_error("Could not create cache directory " + directory);
+}
+
+bool QuantizationCache::Load(const std::string& key, std::vector<std::vector<uint8_t>>& blobs) const
+{
+	const std::filesystem::path path = mDirectory / key;
+	std::error_code error;
+	const uint64_t fileSize = std::filesystem::file_size(path, error);
+	std::ifstream file(path, std::ios::binary);
+	if(error || !file)
+		return false;
+
+	// Magic, number of blobs, their sizes, then their contents:
+	char magic[4];
+	uint32_t numBlobs = 0;
+	if(!file.read(magic, 4) || std::memcmp(magic, kMagic, 4) != 0 || !file.read(reinterpret_cast<char*>(&numBlobs), 4))
+		return false;
+	uint64_t totalSize = 8 + uint64_t(numBlobs) * sizeof(uint64_t);
+	if(totalSize > fileSize)
+		return false;
+	std::vector<uint64_t> sizes(numBlobs);
+	if(!file.read(reinterpret_cast<char*>(sizes.data()), numBlobs * sizeof(uint64_t)))
+		return false;
+	for(uint64_t size: sizes)
+	{
+		if(size > fileSize)
+			return false;
+		totalSize += size;
+	}
+	if(totalSize != fileSize)
+		return false;
+
+	blobs.resize(numBlobs);
+	for(uint32_t i = 0; i < numBlobs; ++i)
+	{
+		blobs[i].resize(sizes[i]);
+		if(!file.read(reinterpret_cast<char*>(blobs[i].data()), sizes[i]))
+			return false;
+	}
+	return true;
+}
+
+bool QuantizationCache::Store(const std::string& key, const std::vector<std::vector<uint8_t>>& blobs) const
+{
+	// Random name, so that concurrent writers of the same entry don't mix their data:
+	std::random_device random;
+	const std::filesystem::path temporaryPath = mDirectory / (key + ".tmp" + std::to_string(random()) + std::to_string(random()));
+	{
+		std::ofstream file(temporaryPath, std::ios::binary);
+		const uint32_t numBlobs = static_cast<uint32_t>(blobs.size());
+		file.write(kMagic, 4);
+		file.write(reinterpret_cast<const char*>(&numBlobs), 4);
+		for(const auto& blob: blobs)
+		{
+			const uint64_t size = blob.size();
+			file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		}
+		for(const auto& blob: blobs)
+			file.write(reinterpret_cast<const char*>(blob.data()), blob.size());
+		file.close();
+		if(!file)
+		{
+			std::error_code error;
+			std::filesystem::remove(temporaryPath, error);
+			return false;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporaryPath, mDirectory / key, error);
+	if(error)
+	{
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,36 @@
+#ifndef QUANTIZATIONCACHE_H
+#define QUANTIZATIONCACHE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/// Quantized images on disk, named by a hash of everything that went into them
+/** Lets batch jobs skip decoding and quantizing sources that didn't change since the last run. Keys are built with
+	Sha256 by the callers, from the source bytes, the palette and all options, plus kVersion. Entries are written
+	to a temporary file and then renamed, so several processes can share a directory. */
+class QuantizationCache
+{
+public:
+	/// Part of every key. Increase it whenever a change to the code changes the quantized output.
+	static constexpr uint32_t kVersion = 1;
+
+	/// Creates the directory if it doesn't exist yet
+	explicit QuantizationCache(const std::string& directory);
+
+	/// Read the entry for key
+	/** @return false if there is none, or it is broken. */
+	bool Load(const std::string& key, std::vector<std::vector<uint8_t>>& blobs) const;
+
+	/// Write the entry for key, replacing any previous one
+	/** A cache that can't be written to, e.g. because it is read-only or the disk is full, must not stop a build,
+		so failures only leave the entry out.
+		@return false if the entry could not be written. */
+	bool Store(const std::string& key, const std::vector<std::vector<uint8_t>>& blobs) const;
+
+private:
+	std::filesystem::path mDirectory;
+};
+
+#endif // QUANTIZATIONCACHE_H
@@ -0,0 +1,124 @@
+#include "ScanlineQuantizer.h"
+#include "ErrorDiffusion.h"
+#include "OrderedDither.h"
+#include "PaletteLookup.h"
+#include "Transparency.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+/// Most rows any kernel in DitherKernel.h touches
+static constexpr int kMaxRows = 3;
+
+template<class Kernel, bool Serpentine>
+static std::function<void(const uint8_t* const[], uint8_t*)> MakeDiffusion(const PaletteLookup& lookup, int width, int channels, DiffusionPrecision precision)
+{
+	auto diffusion = std::make_shared<ErrorDiffusion<Kernel, Serpentine>>(lookup, width, channels, precision);
+	return [diffusion](const uint8_t* const rows[], uint8_t* indices) {diffusion->ProcessRow(rows, indices);};
+}
+
+template<class Kernel>
+static std::function<void(const uint8_t* const[], uint8_t*)> MakeDiffusion(const PaletteLookup& lookup, int width, int channels, const ConversionOptions& options,
+																		   int& numRows)
+{
+	static_assert(Kernel::kRows <= kMaxRows, "Kernel has too many rows");
+	numRows = Kernel::kRows;
+	if(options.serpentine)
+		return MakeDiffusion<Kernel, true>(lookup, width, channels, options.precision);
+	else
+		return MakeDiffusion<Kernel, false>(lookup, width, channels, options.precision);
+}
+
+ScanlineQuantizer::ScanlineQuantizer(const PaletteLookup& lookup, int width, int height, int channels, const ConversionOptions& options, RowSink sink) :
+	mLookup(lookup),
+	mWidth(width),
+	mHeight(height),
+	mChannels(channels),
+	mSink(std::move(sink)),
+	mIndices(width)
+{
+	switch(options.dither)
+	{
+	case DitherMode::NONE:
+		break;
+	case DitherMode::FLOYD_STEINBERG:
+		mDiffuse = MakeDiffusion<FloydSteinbergKernel>(lookup, width, channels, options, mNumRows);
+		break;
+	case DitherMode::ATKINSON:
+		mDiffuse = MakeDiffusion<AtkinsonKernel>(lookup, width, channels, options, mNumRows);
+		break;
+	case DitherMode::SIERRA:
+		mDiffuse = MakeDiffusion<SierraKernel>(lookup, width, channels, options, mNumRows);
+		break;
+	case DitherMode::JARVIS_JUDICE_NINKE:
+		mDiffuse = MakeDiffusion<JarvisKernel>(lookup, width, channels, options, mNumRows);
+		break;
+	case DitherMode::BAYER4:
+		mMap = &ThresholdMap::Bayer4();
+		break;
+	case DitherMode::BAYER8:
+		mMap = &ThresholdMap::Bayer8();
+		break;
+	case DitherMode::BLUE_NOISE:
+		mMap = &ThresholdMap::BlueNoise();
+		break;
+	}
+
+	mRows.resize(static_cast<size_t>(width) * channels * mNumRows);
+	if(mMap)
+		mOffsetRow.resize(static_cast<size_t>(width) * 3);
+}
+
+void ScanlineQuantizer::PushRow(const uint8_t* row)
+{
+	if(mNumPushed == mHeight)
+		throw std::runtime_error("More rows than the image height");
+
+	const size_t rowSize = static_cast<size_t>(mWidth) * mChannels;
+	std::memcpy(mRows.data() + (mNumPushed % mNumRows) * rowSize, row, rowSize);
+	++mNumPushed;
+
+	if(mNumPushed == mHeight)
+	{
+		while(mNumFinished < mHeight)
+			FinishRow();
+	}
+	else if(mNumPushed - mNumFinished == mNumRows)
+		FinishRow();
+}
+
+void ScanlineQuantizer::FinishRow()
+{
+	const int y = mNumFinished;
+	const size_t rowSize = static_cast<size_t>(mWidth) * mChannels;
+	auto sourceRow = [&](int row) {return mRows.data() + (row % mNumRows) * rowSize;};
+	const uint8_t* source = sourceRow(y);
+
+	if(mDiffuse)
+	{
+		// The kernel reads the rows below, nullptr past the last one:
+		const uint8_t* rows[kMaxRows];
+		for(int dy = 0; dy < mNumRows; ++dy)
+			rows[dy] = y + dy < mHeight ? sourceRow(y + dy) : nullptr;
+		mDiffuse(rows, mIndices.data());
+	}
+	else if(mMap)
+	{
+		for(int x = 0; x < mWidth; ++x)
+		{
+			const int offset = mMap->GetOffset(x, y);
+			for(int c = 0; c < 3; ++c)
+				mOffsetRow[x * 3 + c] = std::min(std::max(source[x * mChannels + c] + offset, 0), 255);
+		}
+		mLookup.FindClosest(mOffsetRow.data(), 3, mWidth, mIndices.data());
+	}
+	else
+		mLookup.FindClosest(source, mChannels, mWidth, mIndices.data());
+
+	if(mChannels == 4)
+		SetTransparency(source, mWidth, mIndices.data());
+	mSink(y, mIndices.data());
+	++mNumFinished;
+}
@@ -0,0 +1,63 @@
+#ifndef SCANLINEQUANTIZER_H
+#define SCANLINEQUANTIZER_H
+
+#include "PaletteImage.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class PaletteLookup;
+class ThresholdMap;
+
+/// Quantizes an image that arrives one row at a time
+/** For images too large to keep whole. Only the source rows that error diffusion still reads are kept, so memory
+	use is O(width) regardless of the height. The output is the same as from ConvertToIndexed() or
+	ConvertRgbaToIndexed() with the same lookup and options. Always runs on the calling thread, so
+	ConversionOptions::numThreads, colorCache, bufferPool and finishPixels are not used. Override pixels in the
+	sink instead. */
+class ScanlineQuantizer
+{
+public:
+	/// Receives the indices of row y, with width entries. Rows arrive in order and may be modified.
+	using RowSink = std::function<void(int y, uint8_t* indices)>;
+
+	/// @param channels Bytes per source pixel. With 4, the fourth is alpha, and pixels below 50% get index 255.
+	ScanlineQuantizer(const PaletteLookup& lookup, int width, int height, int channels, const ConversionOptions& options, RowSink sink);
+
+	/// Add the next source row
+	/** Rows are passed to the sink as soon as nothing below them can change them anymore. After the last row,
+		all remaining rows are. */
+	void PushRow(const uint8_t* row);
+
+	/// Source rows kept at a time
+	/** Row y reaches the sink at the latest when row y + GetNumRows() - 1 is pushed. */
+	int GetNumRows() const {return mNumRows;}
+
+private:
+	void FinishRow();
+
+	const PaletteLookup& mLookup;
+	const int mWidth;
+	const int mHeight;
+	const int mChannels;
+	const RowSink mSink;
+
+	/// Threshold map for ordered dithering, or nullptr
+	const ThresholdMap* mMap = nullptr;
+
+	/// ErrorDiffusion::ProcessRow() for the selected kernel, or empty
+	std::function<void(const uint8_t* const rows[], uint8_t* indices)> mDiffuse;
+
+	int mNumRows = 1;
+	int mNumPushed = 0;
+	int mNumFinished = 0;
+
+	/// Ring of mNumRows source rows
+	std::vector<uint8_t> mRows;
+
+	std::vector<uint8_t> mOffsetRow;
+	std::vector<uint8_t> mIndices;
+};
+
+#endif // SCANLINEQUANTIZER_H
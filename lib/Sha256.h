@@ -0,0 +1,34 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// SHA-256 as in FIPS 180-4, for naming files by their content
+class Sha256
+{
+public:
+	Sha256();
+
+	/// Add bytes to the message
+	void Update(const void* data, size_t size);
+
+	/// Add a value as its bytes in memory
+	template<class T>
+	void UpdateValue(const T& value) {Update(&value, sizeof(T));}
+
+	/// Finish the message and return the digest as 64 lowercase hex digits
+	/** Update() must not be called afterwards. */
+	std::string HexDigest();
+
+private:
+	void ProcessBlock(const uint8_t* block);
+
+	uint32_t mState[8];
+	uint8_t mBlock[64];
+	size_t mBlockSize = 0;
+	uint64_t mMessageSize = 0;
+};
+
+#endif // SHA256_H
@@ -13,6 +13,13 @@ StbHdrImage::StbHdrImage(const char* filename, int desired_channels)
 
 }
 
+StbHdrImage::StbHdrImage(uint8_t const* data, size_t size, int desiredChannels)
+{
+	mData = stbi_loadf_from_memory(data, size, &mWidth, &mHeight, &mChannelsInFile, desiredChannels);
+	if(!mData)
+		throw std::runtime_error("Could not load image data");
+}
+
 StbHdrImage::StbHdrImage(StbHdrImage&& other) :
 	mData(other.mData),
 	mWidth(other.mWidth),
@@ -1,6 +1,8 @@
 #ifndef STBHDRIMAGE_H
 #define STBHDRIMAGE_H
 
+#include <cstddef>
+#include <cstdint>
 
 /// Minimal C++ wrapper around an stb_image HDR image
 class StbHdrImage
@@ -8,6 +10,9 @@ class StbHdrImage
 public:
 	StbHdrImage(char const *filename, int desired_channels);
 
+	/// Load from memory
+	StbHdrImage(uint8_t const* data, size_t size, int desiredChannels);
+
 	StbHdrImage(const StbHdrImage&) = delete;
 	StbHdrImage(StbHdrImage&& other);
 	~StbHdrImage();
@@ -1,248 +1,691 @@
 #include "TextureImage.h"
+#include "BufferPool.h"
+#include "DitherKernel.h"
+#include "IndexedImage.h"
+#include "MappedFile.h"
+#include "MipChain.h"
 #include "PaletteImage.h"
-#include "Transparency.h"
-
-#include <molecular/util/FileStreamStorage.h>
+#include "Parallel.h"
+#include "QuantizationCache.h"
+#include "ScanlineQuantizer.h"
+#include "Sha256.h"
+#include "StbHdrImage.h"
+#include "StbImage.h"
 
 #include <stb_image.h>
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include <stb_image_resize2.h>
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 static constexpr int firstFullbrightColor = 224;
 static constexpr int lastFullbrightColor = 254;
 static constexpr int numFullbrightColors = lastFullbrightColor - firstFullbrightColor + 1;
 
-using namespace molecular::util;
+TexturePalette::TexturePalette(const uint8_t* palette, ColorMetric metric) :
+	rgb(palette, palette + 256 * 3),
+	colors(palette, firstFullbrightColor, metric),
+	fullbrights(palette + firstFullbrightColor * 3, numFullbrightColors, metric),
+	metric(metric)
+{
+}
 
-TextureImage::TextureImage(const char* filename)
+TextureImage::TextureImage(const char* filename) :
+	mFile(std::make_shared<MappedFile>(filename))
 {
-	FileReadStorage storage(filename);
-	size_t fileSize = storage.GetSize();
+	// The file is opened once, all checks below and the decoding later use the same bytes:
+	const uint8_t* data = mFile->GetData();
+	const size_t fileSize = mFile->GetSize();
 	if(fileSize > 8)
 	{
 		uint32_t width, height;
-		storage.Read(&width, 4);
-		storage.Read(&height, 4);
+		std::memcpy(&width, data, 4);
+		std::memcpy(&height, data + 4, 4);
 		if(width * height + 8 == fileSize)
 		{
-			mIndexedImage.resize(width * height);
-			storage.Read(mIndexedImage.data(), width * height);
+			mWidth = width;
+			mHeight = height;
+			mIndexedImage.assign(data + 8, data + fileSize);
+			mFile.reset();
 			return;
 		}
 	}
 
-	if(stbi_is_hdr(filename))
-		mHdrImage = std::make_unique<StbHdrImage>(filename, 3);
-	else
-		mImage = std::make_unique<StbImage>(filename, 4);
+	// Only read the header here. Pixels are decoded in ToIndexed():
+	int channels = 0;
+	if(stbi_info_from_memory(data, fileSize, &mWidth, &mHeight, &channels))
+	{
+		mHdr = stbi_is_hdr_from_memory(data, fileSize);
+		return;
+	}
+
+	// Formats that stb_image doesn't know, like PCX:
+	auto palettedImage = IndexedImage::TryLoad(data, fileSize);
+	if(!palettedImage)
+		throw std::runtime_error(std::string("Could not open image file ") + filename);
+	mWidth = palettedImage->GetWidth();
+	mHeight = palettedImage->GetHeight();
 }
 
 void TextureImage::SetEmission(const char* filename)
 {
-	mEmissionImage = std::make_unique<StbImage>(filename, 3);
+	auto file = std::make_shared<MappedFile>(filename);
+	int width, height, channels;
+	if(!stbi_info_from_memory(file->GetData(), file->GetSize(), &width, &height, &channels))
+		throw std::runtime_error(std::string("Could not open image file ") + filename);
+	mEmissionFile = std::move(file);
+	mSourceHash.clear();
+}
+
+/// Linear value to 8 bit, clamped
+static uint8_t ToGammaByte(float value)
+{
+	return static_cast<uint8_t>(std::clamp<int>(std::pow(value, 2.2f) * 255.f + 0.5f, 0, 255));
 }
 
-static std::vector<uint8_t> HdrToIndexed(const StbHdrImage& hdrImage, const uint8_t* palette, int mipLevel, float hdrScale)
+/// Table version of ToGammaByte() without any std::pow() per pixel
+/** A coarse table gives the byte at the start of each bin. The function is monotonic and rises by less than one
+	per bin, so a single comparison with the exact value where the next byte starts makes the result identical to
+	ToGammaByte(). */
+class GammaTable
 {
-	const float* data = hdrImage.Data();
-	int32_t width = hdrImage.GetWidth();
-	int32_t height = hdrImage.GetHeight();
+public:
+	static const GammaTable& Get()
+	{
+		static const GammaTable table;
+		return table;
+	}
+
+	/// @param value Clamped to 0..1.
+	uint8_t operator()(float value) const
+	{
+		const int byte = mBytes[static_cast<int>(value * kSize)];
+		return byte + (value >= mThresholds[byte + 1]);
+	}
 
-	std::vector<float> scaledImage;
-	if(mipLevel != 0)
+	/// ToGammaByte() without rounding, linearly interpolated. Off by less than 1e-5.
+	/** @param value Clamped to 0..1. */
+	float Curve(float value) const
 	{
-		// Scale down by 2, 4, 8 etc. for higher MIP levels:
-		int32_t newWidth = width;
-		int32_t newHeight = height;
-		for(int i = 0; i < mipLevel; ++i)
+		const float position = value * kSize;
+		const int i = std::min(static_cast<int>(position), kSize - 1);
+		return mCurve[i] + (mCurve[i + 1] - mCurve[i]) * (position - i);
+	}
+
+private:
+	static constexpr int kSize = 4096;
+
+	GammaTable()
+	{
+		for(int i = 0; i <= kSize; ++i)
+		{
+			mBytes[i] = ToGammaByte(float(i) / kSize);
+			mCurve[i] = std::pow(float(i) / kSize, 2.2f) * 255.f;
+		}
+
+		// Smallest value for each byte, found by bisection over the bit patterns of positive floats:
+		mThresholds[0] = 0;
+		for(int byte = 1; byte < 256; ++byte)
 		{
-			newWidth /= 2;
-			newHeight /= 2;
+			uint32_t low = 0;
+			uint32_t high = FloatBits(1.f);
+			while(low < high)
+			{
+				const uint32_t middle = low + (high - low) / 2;
+				if(ToGammaByte(BitsFloat(middle)) >= byte)
+					high = middle;
+				else
+					low = middle + 1;
+			}
+			mThresholds[byte] = BitsFloat(low);
 		}
-		scaledImage.resize(newWidth * newHeight * 4);
-		stbir_resize(
-					data, // input_pixels
-					width, // input_w
-					height, // input_h
-					0, // input_stride_in_bytes
-					scaledImage.data(), // output_pixels
-					newWidth,
-					newHeight,
-					0, // output_stride_in_bytes
-					STBIR_RGB, // pixel_layout
-					STBIR_TYPE_FLOAT, // data_type
-					STBIR_EDGE_WRAP, // edge
-					STBIR_FILTER_DEFAULT // filter
-					);
+		mThresholds[256] = 2.f;
+	}
+
+	static uint32_t FloatBits(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, 4);
+		return bits;
+	}
 
-		// Use new image data and size from here:
-		data = scaledImage.data();
-		width = newWidth;
-		height = newHeight;
+	static float BitsFloat(uint32_t bits)
+	{
+		float value;
+		std::memcpy(&value, &bits, 4);
+		return value;
 	}
 
-	std::vector<uint8_t> indexedImage(width * height);
+	uint8_t mBytes[kSize + 1];
+	float mThresholds[257];
+	float mCurve[kSize + 1];
+};
 
-	// Iterate over all pixels:
-	for(int i = 0; i < width * height; ++i)
+/// Error diffusion for HDR images, in the range of ToGammaByte() but without rounding
+/** Normal and fullbright pixels are matched against different parts of the palette, so each kind has its own
+	error state, and errors only spread to pixels of the same kind. State rows hold four float lanes per pixel, see
+	DitherKernel::SpreadFloat(). Only Kernel::kRows rows are kept per kind. */
+template<class Kernel>
+static void DiffuseHdr(const MipImage<float>& image, const TexturePalette& palette, float hdrScale, uint8_t* indices)
+{
+	const GammaTable& gamma = GammaTable::Get();
+	const int32_t width = image.width;
+	const size_t stateSize = static_cast<size_t>(width + 2 * Kernel::kRadius) * 4;
+	const PaletteLookup* lookups[2] = {&palette.colors, &palette.fullbrights};
+	const int firstIndices[2] = {0, firstFullbrightColor};
+	std::vector<float> state[2];
+	for(std::vector<float>& kind: state)
+		kind.resize(stateSize * Kernel::kRows, 0.f);
+
+	for(int32_t y = 0; y < image.height; ++y)
 	{
-		// Colors above 100% map to fullbright colors:
-		if(data[i*3] > 1.f || data[i*3+1] > 1.f || data[i*3+2] > 1.f)
+		float* rows[2][Kernel::kRows];
+		for(int kind = 0; kind < 2; ++kind)
 		{
-			const float rgb[3] = {
-				std::pow(data[i*3] * hdrScale - 1.f, 2.2f) * 255.f + 0.5f,
-				std::pow(data[i*3+1] * hdrScale - 1.f, 2.2f) * 255.f + 0.5f,
-				std::pow(data[i*3+2] * hdrScale -1.f, 2.2f) * 255.f + 0.5f
-			};
-			const uint8_t rgbi[3] = {
-				static_cast<uint8_t>(std::clamp<int>(rgb[0], 0, 255)),
-				static_cast<uint8_t>(std::clamp<int>(rgb[1], 0, 255)),
-				static_cast<uint8_t>(std::clamp<int>(rgb[2], 0, 255)),
-			};
-			indexedImage[i] = FindClosestPaletteColor(rgbi, palette + firstFullbrightColor*3, numFullbrightColors) + firstFullbrightColor;
+			for(int dy = 0; dy < Kernel::kRows; ++dy)
+				rows[kind][dy] = state[kind].data() + ((y + dy) % Kernel::kRows) * stateSize + Kernel::kRadius * 4;
+
+			// The row entering at the bottom starts without error:
+			float* entering = rows[kind][Kernel::kRows - 1] - Kernel::kRadius * 4;
+			std::fill(entering, entering + stateSize, 0.f);
 		}
-		else
+
+		const float* row = image.pixels + static_cast<size_t>(y) * width * 3;
+		for(int32_t x = 0; x < width; ++x)
 		{
-			const float rgb[3] = {
-				std::pow(data[i*3] * hdrScale, 2.2f) * 255.f + 0.5f,
-				std::pow(data[i*3+1] * hdrScale, 2.2f) * 255.f + 0.5f,
-				std::pow(data[i*3+2] * hdrScale, 2.2f) * 255.f + 0.5f
-			};
-			const uint8_t rgbi[3] = {
-				static_cast<uint8_t>(std::clamp<int>(rgb[0], 0, 255)),
-				static_cast<uint8_t>(std::clamp<int>(rgb[1], 0, 255)),
-				static_cast<uint8_t>(std::clamp<int>(rgb[2], 0, 255)),
-			};
-			indexedImage[i] = FindClosestPaletteColor(rgbi, palette, firstFullbrightColor);
+			// Colors above 100% map to fullbright colors, with 100% subtracted:
+			const float* pixel = row + x * 3;
+			const int bright = (pixel[0] > 1.f) | (pixel[1] > 1.f) | (pixel[2] > 1.f);
+			const float* error = rows[bright][0] + x * 4;
+			float value[3];
+			for(int c = 0; c < 3; ++c)
+			{
+				const float wanted = gamma.Curve(std::min(std::max(0.f, pixel[c] * hdrScale - bright), 1.f)) + error[c];
+				value[c] = std::min(std::max(wanted, 0.f), 255.f);
+			}
+
+			const PaletteLookup& lookup = *lookups[bright];
+			const uint8_t index = lookup.FindClosest(static_cast<int>(value[0] + 0.5f), static_cast<int>(value[1] + 0.5f), static_cast<int>(value[2] + 0.5f));
+			indices[static_cast<size_t>(y) * width + x] = index + firstIndices[bright];
+
+			const uint8_t* color = lookup.GetColor(index);
+			const float spread[4] = {value[0] - color[0], value[1] - color[1], value[2] - color[2], 0.f};
+			Kernel::template SpreadFloat<1>(rows[bright], x, spread);
 		}
 	}
-	return indexedImage;
 }
 
-static std::vector<uint8_t> LdrToIndexed(const StbImage& image, const uint8_t* palette, bool dither, int mipLevel)
-{
-	int32_t width = image.GetWidth();
-	int32_t height = image.GetHeight();
-	const uint8_t* imageData = image.Data();
-	std::vector<uint8_t> scaledImage;
-
-	if(mipLevel != 0)
-	{
-		int32_t newWidth = width;
-		int32_t newHeight = height;
-		for(int i = 0; i < mipLevel; ++i)
-		{
-			newWidth /= 2;
-			newHeight /= 2;
-		}
-		scaledImage.resize(newWidth * newHeight * 4);
-		stbir_resize(
-					image.Data(), // input_pixels
-					width,	// input_w
-					height, // input_h
-					width * 4, // input_stride_in_bytes
-					scaledImage.data(), // output_pixels
-					newWidth, // output_w
-					newHeight, // output_h
-					newWidth * 4, // output_stride_in_bytes
-					STBIR_RGBA, // pixel_layout
-					STBIR_TYPE_UINT8, // data_type
-					STBIR_EDGE_WRAP, // edge
-					STBIR_FILTER_DEFAULT // filter
-				);
-		imageData = scaledImage.data();
-		width = newWidth;
-		height = newHeight;
-	}
-
-	auto [color, alpha] = SplitColorAndAlpha(imageData, width, height);
-	auto indexedImage = ConvertToIndexed(color.data(), width, height, palette, dither);
-	SetTransparency(indexedImage, alpha);
+/// @param numThreads Ignored with error diffusion, which runs serially.
+static std::vector<uint8_t> HdrToIndexed(const MipImage<float>& image, const TexturePalette& palette, DitherMode dither, float hdrScale, int numThreads,
+										 BufferPool* pool)
+{
+	const float* data = image.pixels;
+	const int32_t width = image.width;
+	const int32_t height = image.height;
+	const GammaTable& gamma = GammaTable::Get();
+
+	const size_t numPixels = static_cast<size_t>(width) * height;
+	std::vector<uint8_t> indexedImage = pool ? pool->AcquireBytes(numPixels) : std::vector<uint8_t>(numPixels);
+	switch(dither)
+	{
+	case DitherMode::NONE:
+		break;
+	case DitherMode::FLOYD_STEINBERG:
+		DiffuseHdr<FloydSteinbergKernel>(image, palette, hdrScale, indexedImage.data());
+		return indexedImage;
+	case DitherMode::ATKINSON:
+		DiffuseHdr<AtkinsonKernel>(image, palette, hdrScale, indexedImage.data());
+		return indexedImage;
+	case DitherMode::SIERRA:
+		DiffuseHdr<SierraKernel>(image, palette, hdrScale, indexedImage.data());
+		return indexedImage;
+	case DitherMode::JARVIS_JUDICE_NINKE:
+		DiffuseHdr<JarvisKernel>(image, palette, hdrScale, indexedImage.data());
+		return indexedImage;
+	default:
+		throw std::runtime_error("Ordered dithering with HDR not supported");
+	}
+
+	// Sort the pixels of each row into normal and fullbright colors, then look them up in batches. Rows are
+	// independent, so they are split into one band per thread.
+	const int numBands = std::max(std::min(ResolveThreadCount(numThreads), height), 1);
+	ParallelFor(0, numBands, numBands, [&](int band)
+	{
+		std::vector<float> values(width * 3);
+		std::vector<int32_t> bright(width);
+		std::vector<uint8_t> colorPixels(width * 3);
+		std::vector<uint8_t> fullbrightPixels(width * 3);
+		std::vector<int32_t> colorPositions(width);
+		std::vector<int32_t> fullbrightPositions(width);
+		std::vector<uint8_t> indices(width);
+		for(int32_t y = height * band / numBands; y < height * (band + 1) / numBands; ++y)
+		{
+			// Colors above 100% map to fullbright colors, with 100% subtracted. No branches, so this vectorizes:
+			const float* row = data + static_cast<size_t>(y) * width * 3;
+			for(int32_t x = 0; x < width; ++x)
+				bright[x] = (row[x * 3] > 1.f) | (row[x * 3 + 1] > 1.f) | (row[x * 3 + 2] > 1.f);
+			for(int32_t i = 0; i < width * 3; ++i)
+				values[i] = std::min(std::max(0.f, row[i] * hdrScale - bright[i / 3]), 1.f);
+
+			// Every pixel is written to both lists, but only counted in one:
+			size_t numColors = 0;
+			size_t numFullbrights = 0;
+			for(int32_t x = 0; x < width; ++x)
+			{
+				for(int c = 0; c < 3; ++c)
+				{
+					const uint8_t byte = gamma(values[x * 3 + c]);
+					colorPixels[numColors * 3 + c] = byte;
+					fullbrightPixels[numFullbrights * 3 + c] = byte;
+				}
+				colorPositions[numColors] = x;
+				fullbrightPositions[numFullbrights] = x;
+				numColors += 1 - bright[x];
+				numFullbrights += bright[x];
+			}
+
+			uint8_t* indexedRow = indexedImage.data() + static_cast<size_t>(y) * width;
+			palette.colors.FindClosest(colorPixels.data(), 3, numColors, indices.data());
+			for(size_t i = 0; i < numColors; ++i)
+				indexedRow[colorPositions[i]] = indices[i];
+			palette.fullbrights.FindClosest(fullbrightPixels.data(), 3, numFullbrights, indices.data());
+			for(size_t i = 0; i < numFullbrights; ++i)
+				indexedRow[fullbrightPositions[i]] = indices[i] + firstFullbrightColor;
+		}
+	});
 	return indexedImage;
 }
 
-static void AddEmission(std::vector<uint8_t>& indexedImage, const StbImage& emissionImage, const uint8_t* palette, int mipLevel)
+/// Replace pixels [begin, end) with fullbright colors where the emission image is lit
+static void AddEmission(const uint8_t* emissionData, const TexturePalette& palette, size_t begin, size_t end, uint8_t* indexedImage)
 {
-	int32_t width = emissionImage.GetWidth();
-	int32_t height = emissionImage.GetHeight();
-	const uint8_t* emissionData = emissionImage.Data();
-	std::vector<uint8_t> scaledEmissionImage;
-
-	if(mipLevel != 0)
+	// Collect emissive pixels and look them up in one batch:
+	std::vector<uint8_t> emissivePixels;
+	std::vector<size_t> emissivePositions;
+	for(size_t i = begin; i < end; ++i)
 	{
-		int32_t newWidth = width;
-		int32_t newHeight = height;
-		for(int i = 0; i < mipLevel; ++i)
+		const uint8_t* rgb = emissionData + i * 3;
+		if(rgb[0] > 10 || rgb[1] > 10 || rgb[2] > 10)
 		{
-			newWidth /= 2;
-			newHeight /= 2;
+			emissivePixels.insert(emissivePixels.end(), rgb, rgb + 3);
+			emissivePositions.push_back(i);
 		}
-		scaledEmissionImage.resize(newWidth * newHeight * 4);
-		stbir_resize(
-					emissionImage.Data(),
-					width,
-					height,
-					width * 4,
-					scaledEmissionImage.data(), // output_pixels
-					newWidth,
-					newHeight,
-					newWidth * 4, // output_stride_in_bytes
-					STBIR_RGBA, // pixel_layout
-					STBIR_TYPE_UINT8, // data_type
-					STBIR_EDGE_WRAP, // edge
-					STBIR_FILTER_DEFAULT // filter
-				);
-		emissionData = scaledEmissionImage.data();
-		width = newWidth;
-		height = newHeight;
 	}
 
-	if(width * height != indexedImage.size())
+	std::vector<uint8_t> indices(emissivePositions.size());
+	palette.fullbrights.FindClosest(emissivePixels.data(), 3, indices.size(), indices.data());
+	for(size_t i = 0; i < indices.size(); ++i)
+		indexedImage[emissivePositions[i]] = indices[i] + firstFullbrightColor;
+}
+
+static void CheckEmissionSize(const MipImage<uint8_t>& emission, size_t numPixels)
+{
+	if(static_cast<size_t>(emission.width) * emission.height != numPixels)
 		throw std::runtime_error("Emission image has wrong dimensions");
+}
 
-	for(size_t i = 0; i < indexedImage.size(); ++i)
+/// @param emission Emission image at the same MIP level, or nullptr.
+static std::vector<uint8_t> LdrToIndexed(const MipImage<uint8_t>& image, const TexturePalette& palette, DitherMode dither, const MipImage<uint8_t>* emission,
+										 int numThreads, BufferPool* pool)
+{
+	// Quantization, transparency and emission in one pass over the RGBA data:
+	ConversionOptions options;
+	options.dither = dither;
+	options.numThreads = numThreads;
+	options.bufferPool = pool;
+	if(emission)
 	{
-		const uint8_t rgb[3] = {
-			emissionData[i*3],
-			emissionData[i*3+1],
-			emissionData[i*3+2]
-		};
+		CheckEmissionSize(*emission, static_cast<size_t>(image.width) * image.height);
+		options.finishPixels = [&](size_t begin, size_t end, uint8_t* indices) {AddEmission(emission->pixels, palette, begin, end, indices);};
+	}
+	return ConvertRgbaToIndexed(image.pixels, image.width, image.height, palette.colors, options);
+}
 
-		if(rgb[0] > 10 || rgb[1] > 10 || rgb[2] > 10)
-			indexedImage[i] = FindClosestPaletteColor(rgb, palette + firstFullbrightColor*3, numFullbrightColors) + firstFullbrightColor;
+/// One level of one variant
+struct QuantizeJob
+{
+	size_t variant;
+	int level;
+};
+
+/// Call quantize(job, numThreads) for all jobs at the same time
+/** Jobs are sorted by level, so ParallelFor() hands out the largest first. Threads that the smaller ones don't use
+	are shared among the jobs at the top level, which split their tiles among them. */
+static void ForEachJob(const std::vector<QuantizeJob>& jobs, int numThreads, const std::function<void(const QuantizeJob& job, int numThreads)>& quantize)
+{
+	const int threads = ResolveThreadCount(numThreads);
+	const int numJobs = static_cast<int>(jobs.size());
+	int numTopJobs = 0;
+	while(numTopJobs < numJobs && jobs[numTopJobs].level == jobs[0].level)
+		++numTopJobs;
+	const int spareThreads = std::max(threads - numJobs, 0);
+	ParallelFor(0, numJobs, threads, [&](int i)
+	{
+		if(i < numTopJobs)
+			quantize(jobs[i], 1 + spareThreads / numTopJobs + (i < spareThreads % numTopJobs ? 1 : 0));
+		else
+			quantize(jobs[i], 1);
+	});
+}
+
+std::vector<uint8_t> TextureImage::ToIndexed(const uint8_t* palette, DitherMode dither, int mipLevel, float hdrScale)
+{
+	return ToIndexed(TexturePalette(palette), dither, mipLevel, hdrScale);
+}
+
+std::vector<uint8_t> TextureImage::ToIndexed(const TexturePalette& palette, DitherMode dither, int mipLevel, float hdrScale, BufferPool* pool)
+{
+	return std::move(ToIndexedVariants({{&palette, dither, mipLevel}}, 1, hdrScale, 1, pool)[0][0]);
+}
+
+std::vector<std::vector<uint8_t>> TextureImage::ToIndexedMips(const TexturePalette& palette, DitherMode dither, int numLevels, float hdrScale, int numThreads,
+															  BufferPool* pool)
+{
+	return std::move(ToIndexedVariants({{&palette, dither, 0}}, numLevels, hdrScale, numThreads, pool)[0]);
+}
+
+std::vector<std::vector<std::vector<uint8_t>>> TextureImage::ToIndexedVariants(const std::vector<TextureVariant>& variants, int numLevels, float hdrScale,
+																			   int numThreads, BufferPool* pool)
+{
+	if(!mCache)
+		return QuantizeVariants(variants, numLevels, hdrScale, numThreads, pool);
+
+	// Only variants that are not in the cache are decoded and quantized:
+	std::vector<std::vector<std::vector<uint8_t>>> results(variants.size());
+	std::vector<std::string> keys(variants.size());
+	std::vector<TextureVariant> missingVariants;
+	std::vector<size_t> missing;
+	for(size_t i = 0; i < variants.size(); ++i)
+	{
+		keys[i] = GetCacheKey(variants[i], numLevels, hdrScale);
+		if(!LoadFromCache(keys[i], variants[i], numLevels, results[i]))
+		{
+			missingVariants.push_back(variants[i]);
+			missing.push_back(i);
+		}
+	}
+	if(missing.empty())
+		return results;
+
+	auto quantized = QuantizeVariants(missingVariants, numLevels, hdrScale, numThreads, pool);
+	for(size_t i = 0; i < missing.size(); ++i)
+	{
+		mCache->Store(keys[missing[i]], quantized[i]);
+		results[missing[i]] = std::move(quantized[i]);
+	}
+	return results;
+}
+
+std::string TextureImage::GetCacheKey(const TextureVariant& variant, int numLevels, float hdrScale)
+{
+	auto addBytes = [](Sha256& hash, const uint8_t* data, size_t size)
+	{
+		hash.UpdateValue(static_cast<uint64_t>(size));
+		hash.Update(data, size);
+	};
+
+	// Source files are only hashed once per image:
+	if(mSourceHash.empty())
+	{
+		Sha256 hash;
+		hash.UpdateValue(QuantizationCache::kVersion);
+		hash.UpdateValue(static_cast<uint8_t>(mFile ? 1 : 0));
+		if(mFile)
+			addBytes(hash, mFile->GetData(), mFile->GetSize());
+		else
+		{
+			hash.UpdateValue(mWidth);
+			hash.UpdateValue(mHeight);
+			addBytes(hash, mIndexedImage.data(), mIndexedImage.size());
+		}
+		hash.UpdateValue(static_cast<uint8_t>(mEmissionFile ? 1 : 0));
+		if(mEmissionFile)
+			addBytes(hash, mEmissionFile->GetData(), mEmissionFile->GetSize());
+		mSourceHash = hash.HexDigest();
 	}
+
+	Sha256 hash;
+	hash.Update(mSourceHash.data(), mSourceHash.size());
+	addBytes(hash, variant.palette->rgb.data(), variant.palette->rgb.size());
+	hash.UpdateValue(static_cast<int32_t>(variant.palette->metric));
+	hash.UpdateValue(static_cast<int32_t>(variant.dither));
+	hash.UpdateValue(static_cast<int32_t>(variant.firstLevel));
+	hash.UpdateValue(static_cast<int32_t>(numLevels));
+	hash.UpdateValue(hdrScale);
+	return hash.HexDigest();
 }
 
-std::vector<uint8_t> TextureImage::ToIndexed(const uint8_t* palette, bool dither, int mipLevel, float hdrScale)
+bool TextureImage::LoadFromCache(const std::string& key, const TextureVariant& variant, int numLevels, std::vector<std::vector<uint8_t>>& levels) const
 {
-	std::vector<uint8_t> indexedImage;
-	if(mHdrImage)
+	if(!mCache->Load(key, levels) || static_cast<int>(levels.size()) != numLevels)
+		return false;
+	for(int i = 0; i < numLevels; ++i)
 	{
-		if(dither)
-			throw std::runtime_error("Dither with HDR not supported");
+		const int level = variant.firstLevel + i;
+		if(levels[i].size() != static_cast<size_t>(mWidth >> level) * (mHeight >> level))
+			return false;
+	}
+	return true;
+}
 
-		indexedImage = HdrToIndexed(*mHdrImage, palette, mipLevel, hdrScale);
+std::vector<std::vector<std::vector<uint8_t>>> TextureImage::QuantizeVariants(const std::vector<TextureVariant>& variants, int numLevels, float hdrScale,
+																			  int numThreads, BufferPool* pool)
+{
+	// All variants take their levels from the same MIP chain:
+	std::vector<QuantizeJob> jobs;
+	int numChainLevels = 0;
+	for(size_t i = 0; i < variants.size(); ++i)
+	{
+		for(int level = variants[i].firstLevel; level < variants[i].firstLevel + numLevels; ++level)
+			jobs.push_back({i, level});
+		numChainLevels = std::max(numChainLevels, variants[i].firstLevel + numLevels);
 	}
-	else if(mImage)
+	std::stable_sort(jobs.begin(), jobs.end(), [](const QuantizeJob& a, const QuantizeJob& b) {return a.level < b.level;});
+
+	std::vector<std::vector<std::vector<uint8_t>>> results(variants.size(), std::vector<std::vector<uint8_t>>(numLevels));
+	auto result = [&](const QuantizeJob& job) -> std::vector<uint8_t>& {return results[job.variant][job.level - variants[job.variant].firstLevel];};
+	auto palette = [&](const QuantizeJob& job) -> const TexturePalette& {return *variants[job.variant].palette;};
+	auto dither = [&](const QuantizeJob& job) {return variants[job.variant].dither;};
+
+	// Pixels are decoded for this call only, and freed again right after:
+	std::unique_ptr<StbImage> emissionImage;
+	std::vector<MipImage<uint8_t>> emission;
+	if(mEmissionFile)
 	{
-		indexedImage = LdrToIndexed(*mImage, palette, dither, mipLevel);
+		emissionImage = std::make_unique<StbImage>(mEmissionFile->GetData(), mEmissionFile->GetSize(), 3);
+		emission = BuildMipChain(emissionImage->Data(), emissionImage->GetWidth(), emissionImage->GetHeight(), 3, numChainLevels, pool);
 	}
-	else if(!mIndexedImage.empty())
+	auto addEmission = [&](const QuantizeJob& job)
 	{
-		if(mipLevel != 0)
-			throw std::runtime_error("Cannot use picture lump as MIP texture");
-		if(dither)
-			throw std::runtime_error("Cannot dither already indexed image");
-		indexedImage = mIndexedImage;
+		std::vector<uint8_t>& indexedImage = result(job);
+		CheckEmissionSize(emission[job.level], indexedImage.size());
+		AddEmission(emission[job.level].pixels, palette(job), 0, indexedImage.size(), indexedImage.data());
+	};
+
+	std::unique_ptr<StbImage> image;
+	std::unique_ptr<StbHdrImage> hdrImage;
+	std::unique_ptr<IndexedImage> palettedImage;
+	if(mFile)
+	{
+		if(mHdr)
+			hdrImage = std::make_unique<StbHdrImage>(mFile->GetData(), mFile->GetSize(), 3);
+		else if(!(palettedImage = IndexedImage::TryLoad(mFile->GetData(), mFile->GetSize())))
+			image = std::make_unique<StbImage>(mFile->GetData(), mFile->GetSize(), 4);
+	}
+
+	if(hdrImage)
+	{
+		auto chain = BuildMipChain(hdrImage->Data(), hdrImage->GetWidth(), hdrImage->GetHeight(), 3, numChainLevels, pool);
+		ForEachJob(jobs, numThreads, [&](const QuantizeJob& job, int jobThreads)
+		{
+			result(job) = HdrToIndexed(chain[job.level], palette(job), dither(job), hdrScale, jobThreads, pool);
+		});
+		if(pool)
+			ReleaseMipChain(chain, *pool);
+	}
+	else if(image || palettedImage)
+	{
+		// Images that only use palette colors are mapped directly, without any search:
+		std::vector<QuantizeJob> remainingJobs;
+		for(const QuantizeJob& job: jobs)
+		{
+			if(palettedImage && job.level == 0 && KeepsExactColors(dither(job)))
+				result(job) = palettedImage->Remap(palette(job).rgb.data());
+			if(result(job).empty())
+				remainingJobs.push_back(job);
+			else if(emissionImage)
+				addEmission(job);
+		}
+
+		std::vector<uint8_t> rgba;
+		if(palettedImage && !remainingJobs.empty())
+			rgba = palettedImage->ToRgba();
+		auto chain = BuildMipChain(image ? image->Data() : rgba.data(), image ? image->GetWidth() : palettedImage->GetWidth(),
+								   image ? image->GetHeight() : palettedImage->GetHeight(), 4, numChainLevels, pool);
+
+		// Emission is added during quantization:
+		ForEachJob(remainingJobs, numThreads, [&](const QuantizeJob& job, int jobThreads)
+		{
+			result(job) = LdrToIndexed(chain[job.level], palette(job), dither(job), emissionImage ? &emission[job.level] : nullptr, jobThreads, pool);
+		});
+		if(pool)
+		{
+			ReleaseMipChain(chain, *pool);
+			ReleaseMipChain(emission, *pool);
+		}
+		return results;
 	}
 	else
-		throw std::runtime_error("No texture image loaded");
+	{
+		if(numChainLevels > 1)
+			throw std::runtime_error("Cannot use picture lump as MIP texture");
+		for(const QuantizeJob& job: jobs)
+		{
+			if(dither(job) != DitherMode::NONE)
+				throw std::runtime_error("Cannot dither already indexed image");
+			result(job) = mIndexedImage;
+		}
+	}
 
-	if(mEmissionImage)
-		AddEmission(indexedImage, *mEmissionImage.get(), palette, mipLevel);
+	if(emissionImage)
+	{
+		for(const QuantizeJob& job: jobs)
+			addEmission(job);
+		if(pool)
+			ReleaseMipChain(emission, *pool);
+	}
 
-	return indexedImage;
+	return results;
+}
+
+void TextureImage::StreamIndexedMips(const TexturePalette& palette, DitherMode dither, int numLevels, float hdrScale, const MipRowSink& sink)
+{
+	auto passRows = [&](const std::vector<std::vector<uint8_t>>& levels)
+	{
+		for(int level = 0; level < numLevels; ++level)
+		{
+			const int width = mWidth >> level;
+			for(int y = 0; y < (mHeight >> level); ++y)
+				sink(level, y, levels[level].data() + static_cast<size_t>(y) * width);
+		}
+	};
+
+	if(mCache)
+	{
+		const TextureVariant variant = {&palette, dither, 0};
+		std::vector<std::vector<uint8_t>> levels;
+		if(LoadFromCache(GetCacheKey(variant, numLevels, hdrScale), variant, numLevels, levels))
+		{
+			passRows(levels);
+			return;
+		}
+	}
+
+	std::unique_ptr<StbImage> image;
+	std::unique_ptr<IndexedImage> palettedImage;
+	if(mFile && !mHdr && !(palettedImage = IndexedImage::TryLoad(mFile->GetData(), mFile->GetSize())))
+		image = std::make_unique<StbImage>(mFile->GetData(), mFile->GetSize(), 4);
+
+	if(!image && !palettedImage)
+	{
+		passRows(ToIndexedMips(palette, dither, numLevels, hdrScale));
+		return;
+	}
+
+	const int width = image ? image->GetWidth() : palettedImage->GetWidth();
+	const int height = image ? image->GetHeight() : palettedImage->GetHeight();
+
+	std::unique_ptr<StbImage> emissionImage;
+	if(mEmissionFile)
+	{
+		emissionImage = std::make_unique<StbImage>(mEmissionFile->GetData(), mEmissionFile->GetSize(), 3);
+		if(emissionImage->GetWidth() != width || emissionImage->GetHeight() != height)
+			throw std::runtime_error("Emission image has wrong dimensions");
+	}
+
+	// Images that only use palette colors are mapped directly, without any search:
+	std::vector<uint8_t> remapped;
+	if(palettedImage && KeepsExactColors(dither))
+		remapped = palettedImage->Remap(palette.rgb.data());
+
+	// Emission rows are kept until the quantizer of their level is done with the image row:
+	std::vector<std::unique_ptr<ScanlineQuantizer>> quantizers(numLevels);
+	std::vector<std::vector<uint8_t>> emissionRows(numLevels);
+	std::vector<int> numEmissionRows(numLevels, 1);
+	auto finish = [&](int level, int y, uint8_t* indices)
+	{
+		const int levelWidth = width >> level;
+		if(emissionImage)
+		{
+			const uint8_t* emissionRow = emissionRows[level].data() + static_cast<size_t>(y % numEmissionRows[level]) * levelWidth * 3;
+			AddEmission(emissionRow, palette, 0, levelWidth, indices);
+		}
+		sink(level, y, indices);
+	};
+
+	ConversionOptions options;
+	options.dither = dither;
+	for(int level = remapped.empty() ? 0 : 1; level < numLevels; ++level)
+	{
+		quantizers[level] = std::make_unique<ScanlineQuantizer>(palette.colors, width >> level, height >> level, 4, options,
+			[&finish, level](int y, uint8_t* indices) {finish(level, y, indices);});
+		numEmissionRows[level] = quantizers[level]->GetNumRows();
+	}
+	if(emissionImage)
+	{
+		for(int level = 0; level < numLevels; ++level)
+			emissionRows[level].resize(static_cast<size_t>(numEmissionRows[level]) * (width >> level) * 3);
+	}
+
+	MipChainStream emissionChain(width, 3, numLevels, [&](int level, int y, const uint8_t* row)
+	{
+		const size_t rowSize = static_cast<size_t>(width >> level) * 3;
+		std::copy(row, row + rowSize, emissionRows[level].begin() + (y % numEmissionRows[level]) * rowSize);
+	});
+	MipChainStream chain(width, 4, numLevels, [&](int level, int y, const uint8_t* row)
+	{
+		if(quantizers[level])
+			quantizers[level]->PushRow(row);
+		else
+			finish(level, y, remapped.data() + static_cast<size_t>(y) * width);
+	});
+
+	// Emission goes first, so that its rows are there when the image rows are quantized:
+	std::vector<uint8_t> expandedRow(palettedImage ? static_cast<size_t>(width) * 4 : 0);
+	for(int y = 0; y < height; ++y)
+	{
+		if(emissionImage)
+			emissionChain.PushRow(emissionImage->Data() + static_cast<size_t>(y) * width * 3);
+		if(image)
+			chain.PushRow(image->Data() + static_cast<size_t>(y) * width * 4);
+		else
+		{
+			palettedImage->ExpandRow(y, expandedRow.data());
+			chain.PushRow(expandedRow.data());
+		}
+	}
 }
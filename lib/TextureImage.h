@@ -1,12 +1,47 @@
 #ifndef TEXTUREIMAGE_H
 #define TEXTUREIMAGE_H
 
-#include "StbImage.h"
-#include "StbHdrImage.h"
+#include "PaletteImage.h"
+#include "PaletteLookup.h"
 
+#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
+class BufferPool;
+class MappedFile;
+class QuantizationCache;
+
+/// Palette lookups for the normal and the fullbright part of a Quake palette
+/** Building the lookups takes a moment, so create this once and pass it to all conversions. */
+struct TexturePalette
+{
+	explicit TexturePalette(const uint8_t* palette, ColorMetric metric = ColorMetric::RGB);
+
+	/// All 256 entries, RGB
+	std::vector<uint8_t> rgb;
+
+	/// Indices 0..223
+	PaletteLookup colors;
+
+	/// Indices 224..254, relative to the first fullbright color
+	PaletteLookup fullbrights;
+
+	/// Color distance the lookups use
+	ColorMetric metric;
+};
+
+/// One conversion of a TextureImage, see TextureImage::ToIndexedVariants()
+struct TextureVariant
+{
+	const TexturePalette* palette = nullptr;
+	DitherMode dither = DitherMode::NONE;
+
+	/// Size as MIP level of the source image: 0 is full size, 1 half size and so on
+	int firstLevel = 0;
+};
+
 class TextureImage
 {
 public:
@@ -14,16 +49,72 @@ public:
 
 	void SetEmission(const char* filename);
 
-	int GetWidth() const {return mImage ? mImage->GetWidth() : mHdrImage->GetWidth();}
-	int GetHeight() const {return mImage ? mImage->GetHeight() : mHdrImage->GetHeight();}
+	/// Look up quantized images in cache before decoding, and store new ones there
+	/** Entries are keyed by the source files, the palette and all options. nullptr turns the cache off. */
+	void SetCache(QuantizationCache* cache) {mCache = cache;}
 
-	std::vector<uint8_t> ToIndexed(const uint8_t* palette, bool dither, int mipLevel = 0, float hdrScale = 1);
+	int GetWidth() const {return mWidth;}
+	int GetHeight() const {return mHeight;}
+
+	/// Indexed image of a single MIP level
+	/** For more than one level, ToIndexedMips() is faster.
+		@param pool Where to get the result and all working buffers from, or nullptr. */
+	std::vector<uint8_t> ToIndexed(const uint8_t* palette, DitherMode dither, int mipLevel = 0, float hdrScale = 1);
+	std::vector<uint8_t> ToIndexed(const TexturePalette& palette, DitherMode dither, int mipLevel = 0, float hdrScale = 1, BufferPool* pool = nullptr);
+
+	/// Indexed images of MIP levels 0 to numLevels - 1
+	/** The image is scaled down level by level with BuildMipChain(), so every level is derived from the one above
+		it instead of from the full size image. Levels are quantized at the same time, and level 0 is also split
+		among threads.
+		@param numThreads 0 uses all hardware threads. The output does not depend on this.
+		@param pool See ToIndexed(). Release the levels there once they are written. */
+	std::vector<std::vector<uint8_t>> ToIndexedMips(const TexturePalette& palette, DitherMode dither, int numLevels, float hdrScale = 1, int numThreads = 1,
+													BufferPool* pool = nullptr);
+
+	/// Indexed MIP levels of several variants from one decoded image
+	/** The image is decoded and scaled down only once, for all levels that any variant needs, and all variants
+		and their levels are quantized at the same time. The output of each variant is the same as from
+		ToIndexedMips() at its size.
+		@return Levels firstLevel to firstLevel + numLevels - 1 of each variant. */
+	std::vector<std::vector<std::vector<uint8_t>>> ToIndexedVariants(const std::vector<TextureVariant>& variants, int numLevels, float hdrScale = 1,
+																	 int numThreads = 1, BufferPool* pool = nullptr);
+
+	/// Receives row y of a MIP level, with GetWidth() >> level indices
+	using MipRowSink = std::function<void(int level, int y, const uint8_t* indices)>;
+
+	/// ToIndexedMips() one row at a time, for very large images
+	/** Rows are scaled down and quantized as they are needed and passed to sink as soon as they are done, so
+		apart from the decoded source, memory use is a few rows per level. Rows of each level arrive in order. The
+		output is the same as from ToIndexedMips(), but everything runs on the calling thread. HDR images and
+		picture lumps are converted whole and then passed on row by row. Only cache hits are used, new results
+		are not stored, because that would need them whole. */
+	void StreamIndexedMips(const TexturePalette& palette, DitherMode dither, int numLevels, float hdrScale, const MipRowSink& sink);
 
 private:
-	std::unique_ptr<StbImage> mImage;
-	std::unique_ptr<StbImage> mEmissionImage;
-	std::unique_ptr<StbHdrImage> mHdrImage;
+	std::vector<std::vector<std::vector<uint8_t>>> QuantizeVariants(const std::vector<TextureVariant>& variants, int numLevels, float hdrScale, int numThreads,
+																	BufferPool* pool);
+
+	/// Name of the cache entry for levels firstLevel to firstLevel + numLevels - 1 of a variant
+	std::string GetCacheKey(const TextureVariant& variant, int numLevels, float hdrScale);
+
+	/// Cache entry, if it exists and has the right size
+	bool LoadFromCache(const std::string& key, const TextureVariant& variant, int numLevels, std::vector<std::vector<uint8_t>>& levels) const;
+
+	/// Source files, kept open to decode them later. Shared by copies.
+	std::shared_ptr<const MappedFile> mFile;
+	std::shared_ptr<const MappedFile> mEmissionFile;
+
+	int mWidth = 0;
+	int mHeight = 0;
+	bool mHdr = false;
+
+	/// Picture lump, which is tiny and already indexed, so it is read right away
 	std::vector<uint8_t> mIndexedImage;
+
+	QuantizationCache* mCache = nullptr;
+
+	/// Hash of the source and emission files, the part of the cache keys that is the same for all conversions
+	std::string mSourceHash;
 };
 
 #endif // TEXTUREIMAGE_H
@@ -1,13 +1,11 @@
 #ifndef TRANSPARENCY_H
 #define TRANSPARENCY_H
 
+#include <cstddef>
 #include <cstdint>
-#include <vector>
 
-/// Split RGBA image into RGB and A
-std::pair<std::vector<uint8_t>, std::vector<uint8_t>> SplitColorAndAlpha(const uint8_t* data, int width, int height);
-
-/// Set pixel value to 255 where the alpha image is < 50%
-void SetTransparency(std::vector<uint8_t>& indexedImage, const std::vector<uint8_t>& alpha);
+/// Set index to 255 where the alpha of an RGBA pixel is < 50%
+/** Reads alpha straight from the interleaved pixels, so no separate alpha image is needed. */
+void SetTransparency(const uint8_t* rgba, size_t count, uint8_t* indices);
 
 #endif // TRANSPARENCY_H
@@ -28,7 +28,12 @@ SOFTWARE.
 #include "MdlJson.h"
 #include "MdlUtils.h"
 #include <TextureImage.h>
+#include <BufferPool.h>
+#include <DepFile.h>
+#include <OutputFile.h>
+#include <Parallel.h>
 #include <QuakePalette.h>
+#include <QuantizationCache.h>
 #include <StbImage.h>
 
 #include <molecular/util/FileStreamStorage.h>
@@ -39,6 +44,7 @@ SOFTWARE.
 
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 using namespace molecular;
 using namespace molecular::util;
@@ -102,15 +108,18 @@ void ProcessStaticModel(const std::string& objPath,
 						const std::string& outputPath,
 						const std::string& texturePath,
 						const std::string& emissionPath,
-						const uint8_t* paletteData,
-						bool dither,
+						const TexturePalette& palette,
+						DitherMode dither,
 						float hdrScale,
-						uint32_t flags)
+						uint32_t flags,
+						QuantizationCache* cache,
+						std::vector<std::string>& inputFiles)
 {
 	TextureImage textureImage(texturePath.c_str());
 	if(!emissionPath.empty())
 		textureImage.SetEmission(emissionPath.c_str());
-	auto skin = textureImage.ToIndexed(paletteData, dither, 0, hdrScale);
+	textureImage.SetCache(cache);
+	auto skin = textureImage.ToIndexed(palette, dither, 0, hdrScale);
 
 	std::vector<uint32_t> indices;
 	std::vector<Vector3> positions;
@@ -118,18 +127,24 @@ void ProcessStaticModel(const std::string& objPath,
 	std::vector<Vector2> uvs;
 
 	ReadObj(objPath, indices, positions, normals, uvs);
+	inputFiles.push_back(objPath);
+	inputFiles.push_back(texturePath);
+	if(!emissionPath.empty())
+		inputFiles.push_back(emissionPath);
 	WriteSimpleMdl(indices, positions, normals, uvs, skin, textureImage.GetWidth(), textureImage.GetHeight(), flags, outputPath);
 }
 
 
-void ProcessComplexModel(const std::string& jsonPath, const std::string& outputPath, const uint8_t* paletteData, bool dither, float hdrScale, uint32_t flags)
+void ProcessComplexModel(const std::string& jsonPath, const std::string& outputPath, const TexturePalette& palette, DitherMode dither, float hdrScale, uint32_t flags,
+						 QuantizationCache* cache, int numThreads, std::vector<std::string>& inputFiles)
 {
-	MdlJson::Data data = MdlJson::Read(jsonPath);
+	MdlJson::Data data = MdlJson::Read(jsonPath, numThreads);
+	inputFiles.insert(inputFiles.end(), data.inputFiles.begin(), data.inputFiles.end());
 
 	auto [skinWidth, skinHeight] = data.GetSkinWidthHeight();
 
-	std::vector<Vector3> allPositions = data.CollectAllPositions();
-	auto [min, max] = GetMinMax(allPositions);
+	const Vector3 min = data.minPosition;
+	const Vector3 max = data.maxPosition;
 
 	MdlFile::Header header;
 	header.scale = (max - min) / 255.0;
@@ -148,26 +163,54 @@ void ProcessComplexModel(const std::string& jsonPath, const std::string& outputP
 	MdlFile mdl(file);
 	mdl.WriteHeader(header);
 
-	// Write skins:
-	for(auto& skin: data.skins)
-		std::visit([&](auto&& arg)
-		{
-			using T = std::decay_t<decltype(arg)>;
-			if constexpr (std::is_same_v<T, MdlJson::SimpleSkin>)
+	// Skins, including those in groups, are quantized in parallel, in batches of at least one skin per thread. Each
+	// batch is written in order and its buffers go back to the pool, where the next batch picks them up again:
+	const size_t batchSize = ResolveThreadCount(numThreads);
+	BufferPool pool;
+	for(auto batchBegin = data.skins.begin(); batchBegin != data.skins.end();)
+	{
+		std::vector<MdlJson::SimpleSkin*> simpleSkins;
+		auto batchEnd = batchBegin;
+		for(; batchEnd != data.skins.end() && simpleSkins.size() < batchSize; ++batchEnd)
+			std::visit([&](auto&& arg)
 			{
-				auto indexedSkin = arg.ToIndexed(paletteData, dither, 0, hdrScale);
-				mdl.WriteSkin(indexedSkin.data());
-			}
-			else if constexpr (std::is_same_v<T, MdlJson::SkinGroup>)
+				using T = std::decay_t<decltype(arg)>;
+				if constexpr (std::is_same_v<T, MdlJson::SimpleSkin>)
+					simpleSkins.push_back(&arg);
+				else if constexpr (std::is_same_v<T, MdlJson::SkinGroup>)
+				{
+					for(auto& skin: arg.skins)
+						simpleSkins.push_back(&skin);
+				}
+			}, *batchEnd);
+
+		std::vector<std::vector<uint8_t>> indexedSkins(simpleSkins.size());
+		ParallelFor(0, static_cast<int>(simpleSkins.size()), numThreads, [&](int i)
+		{
+			simpleSkins[i]->SetCache(cache);
+			indexedSkins[i] = simpleSkins[i]->ToIndexed(palette, dither, 0, hdrScale, &pool);
+		});
+
+		auto nextSkin = indexedSkins.begin();
+		for(; batchBegin != batchEnd; ++batchBegin)
+			std::visit([&](auto&& arg)
 			{
-				std::vector<std::vector<uint8_t>> skins;
-				for(auto& skin: arg.skins)
+				using T = std::decay_t<decltype(arg)>;
+				if constexpr (std::is_same_v<T, MdlJson::SimpleSkin>)
 				{
-					skins.push_back(skin.ToIndexed(paletteData, dither, 0, hdrScale));
+					mdl.WriteSkin(nextSkin->data());
+					pool.Release(std::move(*nextSkin++));
 				}
-				mdl.WriteSkinGroup(arg.times, skins);
-			}
-		}, skin);
+				else if constexpr (std::is_same_v<T, MdlJson::SkinGroup>)
+				{
+					std::vector<std::vector<uint8_t>> skins(std::make_move_iterator(nextSkin), std::make_move_iterator(nextSkin + arg.skins.size()));
+					nextSkin += arg.skins.size();
+					mdl.WriteSkinGroup(arg.times, skins);
+					for(auto& indexedSkin: skins)
+						pool.Release(std::move(indexedSkin));
+				}
+			}, *batchBegin);
+	}
 
 	// Write UVs and triangles:
 	for(auto& uv: data.mainUvs)
@@ -175,42 +218,53 @@ void ProcessComplexModel(const std::string& jsonPath, const std::string& outputP
 	for(size_t i = 0; i < data.mainIndices.size(); i += 3)
 		WriteReversedTriangle(mdl, data.mainIndices.data() + i);
 
-	// Write frames:
+	// Pack the frames of all groups in parallel:
+	std::vector<const MdlJson::SimpleFrame*> simpleFrames;
 	for(auto& frame: data.frames)
 		std::visit([&](auto&& arg)
 		{
 			using T = std::decay_t<decltype(arg)>;
 			if constexpr (std::is_same_v<T, MdlJson::SimpleFrame>)
+				simpleFrames.push_back(&arg);
+			else if constexpr (std::is_same_v<T, MdlJson::FrameGroup>)
 			{
-				if(arg.positions.size() != data.mainPositions.size())
-				{
-					std::ostringstream oss;
-					oss << "Vertex count varies between frames. " << arg.positions.size() << " (" << arg.name << ") vs. " << data.mainPositions.size() << " (main)";
-					throw std::runtime_error(oss.str());
-				}
-				MdlFile::SimpleFrame frame;
-				frame.vertices = ToTriangleVertices(arg.positions, arg.normals, header.origin, header.scale);
-				auto [minV, maxV] = GetMinMax(frame.vertices);
-				frame.min = minV;
-				frame.max = maxV;
-				frame.name = arg.name;
-				mdl.WriteSingleFrame(frame);
+				for(auto& frame: arg.frames)
+					simpleFrames.push_back(&frame);
 			}
+		}, frame);
+
+	std::vector<MdlFile::SimpleFrame> packedFrames(simpleFrames.size());
+	ParallelFor(0, static_cast<int>(simpleFrames.size()), numThreads, [&](int i)
+	{
+		const MdlJson::SimpleFrame& frame = *simpleFrames[i];
+		if(frame.positions.size() != data.mainPositions.size())
+		{
+			std::ostringstream oss;
+			oss << "Vertex count varies between frames. " << frame.positions.size() << " (" << frame.name << ") vs. " << data.mainPositions.size() << " (main)";
+			throw std::runtime_error(oss.str());
+		}
+		MdlFile::SimpleFrame& mdlFrame = packedFrames[i];
+		mdlFrame.vertices = ToTriangleVertices(frame.positions, frame.normals, header.origin, header.scale);
+		auto [minV, maxV] = GetMinMax(mdlFrame.vertices);
+		mdlFrame.min = minV;
+		mdlFrame.max = maxV;
+		mdlFrame.name = frame.name;
+	});
+
+	// Write frames in order:
+	auto nextFrame = packedFrames.begin();
+	for(auto& frame: data.frames)
+		std::visit([&](auto&& arg)
+		{
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, MdlJson::SimpleFrame>)
+				mdl.WriteSingleFrame(*nextFrame++);
 			else if constexpr (std::is_same_v<T, MdlJson::FrameGroup>)
 			{
-				std::vector<MdlFile::SimpleFrame> frames;
-				for(auto& frame: arg.frames)
-				{
-					if(frame.positions.size() != data.mainPositions.size())
-						throw std::runtime_error("Vertex count varies between frames");
-					MdlFile::SimpleFrame mdlFrame;
-					mdlFrame.vertices = ToTriangleVertices(frame.positions, frame.normals, header.origin, header.scale);
-					auto [minV, maxV] = GetMinMax(mdlFrame.vertices);
-					mdlFrame.min = minV;
-					mdlFrame.max = maxV;
+				std::vector<MdlFile::SimpleFrame> frames(std::make_move_iterator(nextFrame), std::make_move_iterator(nextFrame + arg.frames.size()));
+				nextFrame += arg.frames.size();
+				for(auto& mdlFrame: frames)
 					mdlFrame.name = "frame1";
-					frames.push_back(mdlFrame);
-				}
 
 				// Get overall min/max:
 				MdlFile::TriangleVertex max = {{0, 0, 0}, 0};
@@ -233,12 +287,18 @@ int Main(int argc, char** argv)
 	CommandLineParser cmd;
 	CommandLineParser::PositionalArg<std::string> inFileName(cmd, "input file", "Input mesh");
 	CommandLineParser::PositionalArg<std::string> outFileName(cmd, "output file", "Output MDL file");
-	CommandLineParser::Flag dither(cmd, "dither", "Enable dithering for textures");
+	CommandLineParser::Flag dither(cmd, "dither", "Enable Floyd-Steinberg dithering for textures");
+	CommandLineParser::Option<std::string> ditherModeOption(cmd, "dither-mode", "Dithering mode for textures: none, floyd-steinberg, atkinson, sierra, jarvis, bayer4, bayer8 or blue-noise. Overrides --dither.");
 	CommandLineParser::Option<std::string> texture(cmd, "texture", "Texture to use", "");
 	CommandLineParser::Option<std::string> palette(cmd, "palette", "Palette to use instead of default Quake palette. Can be image or lump.");
+	CommandLineParser::Option<std::string> metric(cmd, "metric", "Color distance for palette matching: rgb or oklab", "rgb");
 	CommandLineParser::Option<std::string> emission(cmd, "emission", "Emission texture to use for fullbright colors.");
 	CommandLineParser::Option<float> hdrScale(cmd, "hdr-scale", "Controls brightness when using HDR images.", 1.0f);
 	CommandLineParser::Option<uint32_t> flags(cmd, "flags", "Set MDL flags.", 0);
+	CommandLineParser::Option<std::string> cacheDirectory(cmd, "cache", "Directory for quantized skins. Unchanged skins are taken from there without decoding.");
+	CommandLineParser::Option<int> threads(cmd, "threads", "Number of threads for quantizing skins and for reading and packing frames, 0 uses all hardware threads. The output does not depend on this.", 0);
+	CommandLineParser::Option<std::string> depFile(cmd, "depfile", "Write the input files read, including those referenced by JSON files, as Makefile rule.");
+	CommandLineParser::Flag keepUnchanged(cmd, "keep-unchanged", "Don't touch the output file if its contents would be the same.");
 	CommandLineParser::HelpFlag help(cmd);
 
 	try
@@ -259,6 +319,16 @@ int Main(int argc, char** argv)
 		loadedPalette = LoadPaletteFile(palette->c_str());
 		paletteData = loadedPalette.data();
 	}
+	const DitherMode ditherMode = ditherModeOption ? ParseDitherMode(*ditherModeOption) : dither ? DitherMode::FLOYD_STEINBERG : DitherMode::NONE;
+	const TexturePalette texturePalette(paletteData, ParseColorMetric(*metric));
+	std::unique_ptr<QuantizationCache> cache;
+	if(cacheDirectory)
+		cache = std::make_unique<QuantizationCache>(*cacheDirectory);
+
+	OutputFile output(*outFileName, static_cast<bool>(keepUnchanged));
+	std::vector<std::string> inputFiles;
+	if(palette)
+		inputFiles.push_back(*palette);
 
 	if(StringUtils::EndsWith(*inFileName, ".obj"))
 	{
@@ -268,14 +338,18 @@ int Main(int argc, char** argv)
 			return EXIT_FAILURE;
 		}
 
-		ProcessStaticModel(*inFileName, *outFileName, *texture, *emission, paletteData, dither, *hdrScale, *flags);
+		ProcessStaticModel(*inFileName, output.GetPath(), *texture, *emission, texturePalette, ditherMode, *hdrScale, *flags, cache.get(), inputFiles);
 	}
 	else if(StringUtils::EndsWith(*inFileName, ".json"))
 	{
-		ProcessComplexModel(*inFileName, *outFileName, paletteData, dither, *hdrScale, *flags);
+		ProcessComplexModel(*inFileName, output.GetPath(), texturePalette, ditherMode, *hdrScale, *flags, cache.get(), *threads, inputFiles);
 	}
 	else
 		throw std::runtime_error("Unrecognized input file type");
+
+	output.Commit();
+	if(depFile)
+		WriteDepFile(*depFile, {*outFileName}, inputFiles);
 	return EXIT_SUCCESS;
 }
 
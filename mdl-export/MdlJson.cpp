@@ -1,10 +1,14 @@
 #include "MdlJson.h"
 #include "MdlUtils.h"
 
+#include <Parallel.h>
+
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
 #include <fstream>
 #include <stdexcept>
+#include <tuple>
 
 using namespace molecular;
 using namespace molecular::util;
@@ -13,12 +17,17 @@ using json = nlohmann::json;
 namespace MdlJson
 {
 
-static SimpleSkin ReadSkin(const json& skin)
+static SimpleSkin ReadSkin(const json& skin, std::vector<std::string>& inputFiles)
 {
 	std::string image = skin.at("image");
 	TextureImage out(image.c_str());
+	inputFiles.push_back(image);
 	if(skin.contains("emission-image"))
-		out.SetEmission(skin.at("emission-image").get<std::string>().c_str());
+	{
+		std::string emissionImage = skin.at("emission-image");
+		out.SetEmission(emissionImage.c_str());
+		inputFiles.push_back(emissionImage);
+	}
 
 	return out;
 }
@@ -36,7 +45,7 @@ static SimpleFrame ReadFrame(const json& frame)
 	return out;
 }
 
-Data Read(const std::string& filename)
+Data Read(const std::string& filename, int numThreads)
 {
 	Data out;
 
@@ -45,14 +54,18 @@ Data Read(const std::string& filename)
 		throw std::runtime_error("Error opening " + filename);
 	nlohmann::json j;
 	i >> j;
+	out.inputFiles.push_back(filename);
 
-	ReadObj(j.at("mesh"), out.mainIndices, out.mainPositions, out.mainNormals, out.mainUvs);
+	std::string mesh = j.at("mesh");
+	ReadObj(mesh, out.mainIndices, out.mainPositions, out.mainNormals, out.mainUvs);
+	out.inputFiles.push_back(mesh);
+	std::tie(out.minPosition, out.maxPosition) = GetMinMax(out.mainPositions);
 
 	// Process skins
 	for (const auto &skin : j.at("skins"))
 	{
 		if (skin.is_object())
-			out.skins.push_back(ReadSkin(skin));
+			out.skins.push_back(ReadSkin(skin, out.inputFiles));
 		else if (skin.is_array())
 		{
 			SkinGroup group;
@@ -62,18 +75,50 @@ Data Read(const std::string& filename)
 
 			// Read images:
 			for (const auto &inner_skin : skin)
-				group.skins.push_back(ReadSkin(inner_skin));
+				group.skins.push_back(ReadSkin(inner_skin, out.inputFiles));
 			out.skins.push_back(std::move(group));
 		}
 		else
 			throw std::runtime_error("Unexpected skin element");
 	}
 
-	// Process frames
-	for (const auto &frame : j["frames"])
+	// Process frames. Their OBJ files are read in parallel, then sorted into groups in manifest order:
+	const json& jsonFrames = j["frames"];
+	std::vector<const json*> frameElements;
+	for (const auto &frame : jsonFrames)
+	{
+		if (frame.is_object())
+			frameElements.push_back(&frame);
+		else if (frame.is_array())
+		{
+			for (const auto &inner_frame : frame)
+				frameElements.push_back(&inner_frame);
+		}
+	}
+	for (const json* frame : frameElements)
+		out.inputFiles.push_back(frame->at("mesh"));
+
+	std::vector<SimpleFrame> frames(frameElements.size());
+	std::vector<std::pair<Vector3, Vector3>> frameBounds(frameElements.size());
+	ParallelFor(0, static_cast<int>(frames.size()), numThreads, [&](int i)
+	{
+		frames[i] = ReadFrame(*frameElements[i]);
+		frameBounds[i] = GetMinMax(frames[i].positions);
+	});
+	for (const auto& [frameMin, frameMax] : frameBounds)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			out.minPosition[i] = std::min(out.minPosition[i], frameMin[i]);
+			out.maxPosition[i] = std::max(out.maxPosition[i], frameMax[i]);
+		}
+	}
+
+	auto nextFrame = frames.begin();
+	for (const auto &frame : jsonFrames)
 	{
 		if (frame.is_object())
-			out.frames.push_back(ReadFrame(frame));
+			out.frames.push_back(std::move(*nextFrame++));
 		else if (frame.is_array())
 		{
 			FrameGroup group;
@@ -82,36 +127,15 @@ Data Read(const std::string& filename)
 			for (const auto &inner_frame : frame)
 				group.times.push_back(inner_frame.at("time"));
 
-			// Read images:
-			for (const auto &inner_frame : frame)
-				group.frames.push_back(ReadFrame(inner_frame));
-			out.frames.push_back(group);
+			for (size_t i = 0; i < frame.size(); ++i)
+				group.frames.push_back(std::move(*nextFrame++));
+			out.frames.push_back(std::move(group));
 		}
 	}
 
 	return out;
 }
 
-std::vector<Vector3> Data::CollectAllPositions()
-{
-	std::vector<Vector3> allPositions = mainPositions;
-
-	// Collect all frame vertices:
-	for(auto& frame: frames)
-		std::visit([&](auto&& arg)
-		{
-			using T = std::decay_t<decltype(arg)>;
-			if constexpr (std::is_same_v<T, MdlJson::SimpleFrame>)
-			   allPositions.insert(allPositions.end(), arg.positions.begin(), arg.positions.end());
-			else if constexpr (std::is_same_v<T, MdlJson::FrameGroup>)
-			{
-				for(auto& frame: arg.frames)
-					allPositions.insert(allPositions.end(), frame.positions.begin(), frame.positions.end());
-			}
-		}, frame);
-	return allPositions;
-}
-
 std::pair<unsigned int, unsigned int> Data::GetSkinWidthHeight()
 {
 	unsigned int skinWidth = 0;
@@ -51,16 +51,21 @@ struct Data
 	std::vector<Skin> skins;
 	std::vector<Frame> frames;
 
-	/// Get all positions from the main mesh and from all frames
-	/** For min/max calculation. */
-	std::vector<molecular::util::Vector3> CollectAllPositions();
+	/// The JSON file and all OBJ and image files it references
+	std::vector<std::string> inputFiles;
+
+	/// Bounding box of the main mesh and all frames
+	/** Calculated by Read() while the frames are read, so their positions never need to be collected in one place. */
+	molecular::util::Vector3 minPosition;
+	molecular::util::Vector3 maxPosition;
 
 	/** Throws if not all skins have the same width and height. */
 	std::pair<unsigned int, unsigned int> GetSkinWidthHeight();
 };
 
 /// Read data from a JSON file and the referenced OBJ and image files
-Data Read(const std::string& filename);
+/** The frame OBJ files are read on up to numThreads threads, 0 uses all hardware threads. */
+Data Read(const std::string& filename, int numThreads = 1);
 
 }
 
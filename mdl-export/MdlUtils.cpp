@@ -17,15 +17,47 @@ std::pair<Vector3, Vector3> GetMinMax(const std::vector<Vector3>& positions)
 {
 	Vector3 min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
 	Vector3 max(std::numeric_limits<float>::min(), std::numeric_limits<float>::min(), std::numeric_limits<float>::min());
-	for(auto& pos: positions)
+	ExpandMinMax(positions, min, max);
+	return std::make_pair(min, max);
+}
+
+void ExpandMinMax(const std::vector<Vector3>& positions, Vector3& min, Vector3& max)
+{
+	static_assert(sizeof(Vector3) == 3 * sizeof(float), "Positions are read as one float array");
+
+	// Four positions per step into twelve independent lanes, which the compiler turns into SIMD min/max:
+	constexpr size_t kLanes = 12;
+	float minLanes[kLanes];
+	float maxLanes[kLanes];
+	for(size_t j = 0; j < kLanes; ++j)
 	{
-		for(int i = 0; i < 3; ++i)
+		minLanes[j] = min[j % 3];
+		maxLanes[j] = max[j % 3];
+	}
+
+	const size_t numComponents = positions.size() * 3;
+	const float* components = positions.empty() ? nullptr : &positions[0][0];
+	size_t i = 0;
+	for(; i + kLanes <= numComponents; i += kLanes)
+	{
+		for(size_t j = 0; j < kLanes; ++j)
 		{
-			min[i] = std::min(min[i], pos[i]);
-			max[i] = std::max(max[i], pos[i]);
+			const float component = components[i + j];
+			minLanes[j] = component < minLanes[j] ? component : minLanes[j];
+			maxLanes[j] = maxLanes[j] < component ? component : maxLanes[j];
 		}
 	}
-	return std::make_pair(min, max);
+	for(size_t j = 0; i < numComponents; ++i, ++j)
+	{
+		minLanes[j] = std::min(minLanes[j], components[i]);
+		maxLanes[j] = std::max(maxLanes[j], components[i]);
+	}
+
+	for(size_t j = 0; j < kLanes; ++j)
+	{
+		min[j % 3] = std::min(min[j % 3], minLanes[j]);
+		max[j % 3] = std::max(max[j % 3], maxLanes[j]);
+	}
 }
 
 std::pair<MdlFile::TriangleVertex, MdlFile::TriangleVertex> GetMinMax(const std::vector<MdlFile::TriangleVertex>& vertices)
@@ -81,6 +113,8 @@ std::vector<MdlFile::TriangleVertex> ToTriangleVertices(const std::vector<Vector
 	assert(positions.size() == normals.size());
 
 	std::vector<MdlFile::TriangleVertex> out;
+	std::vector<uint8_t> normalIndices(normals.size());
+	QuakeNormals(normals.data(), normals.size(), normalIndices.data());
 
 	for(size_t i = 0; i < positions.size(); ++i)
 	{
@@ -89,7 +123,7 @@ std::vector<MdlFile::TriangleVertex> ToTriangleVertices(const std::vector<Vector
 		vert.packedPositions[0] = pos[0];
 		vert.packedPositions[1] = pos[1];
 		vert.packedPositions[2] = pos[2];
-		vert.lightNormalIndex = QuakeNormal(normals[i]);
+		vert.lightNormalIndex = normalIndices[i];
 		out.push_back(vert);
 	}
 
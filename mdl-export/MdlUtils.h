@@ -10,6 +10,9 @@
 /// Get minimum and maximum float vertex
 std::pair<molecular::util::Vector3, molecular::util::Vector3> GetMinMax(const std::vector<molecular::util::Vector3>& positions);
 
+/// Extend min and max to include positions
+void ExpandMinMax(const std::vector<molecular::util::Vector3>& positions, molecular::util::Vector3& min, molecular::util::Vector3& max);
+
 /// Get minimum and maximum packed vertex
 std::pair<MdlFile::TriangleVertex, MdlFile::TriangleVertex> GetMinMax(const std::vector<MdlFile::TriangleVertex>& vertices);
 
@@ -23,10 +23,19 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include "QuakeNormal.h"
+
 #include <molecular/util/Vector3.h>
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
+#ifdef __SSE2__
+#define QUAKENORMAL_SSE2
+#include <emmintrin.h>
+#endif
+
 using namespace molecular::util;
 
 static const std::vector<Vector3> normals = {
@@ -194,7 +203,8 @@ static const std::vector<Vector3> normals = {
 	Vector3(-0.688191, -0.587785, -0.425325)
 };
 
-uint8_t QuakeNormal(const Vector3& n)
+/// Search all normals
+static uint8_t FindClosestNormal(const Vector3& n)
 {
 	uint8_t bestIndex = 0;
 	float bestDot = -1;
@@ -211,3 +221,223 @@ uint8_t QuakeNormal(const Vector3& n)
 
 	return bestIndex;
 }
+
+/// Whether the error margins of NormalGrid hold for n
+/** Not for zero, tiny, huge or non-finite vectors. */
+static bool IsGridSafe(const Vector3& n)
+{
+	if(!std::isfinite(n[0]) || !std::isfinite(n[1]) || !std::isfinite(n[2]))
+		return false;
+	const float major = std::max({std::abs(n[0]), std::abs(n[1]), std::abs(n[2])});
+	return major > 1e-10f && major < 1e10f;
+}
+
+/// Cube map from directions to the few normals that can be closest to them
+/** Each face of the cube is divided into kResolution x kResolution cells. A cell lists every normal that is the
+	closest one for some direction in the cell, with a margin for rounding, in ascending order. Checking only those
+	with the same comparison as FindClosestNormal() therefore gives the same result, ties included. */
+class NormalGrid
+{
+public:
+	static constexpr int kShift = 5;
+	static constexpr int kResolution = 1 << kShift;
+
+	static const NormalGrid& Get()
+	{
+		static const NormalGrid grid;
+		return grid;
+	}
+
+	/// Cell of a direction that IsGridSafe()
+	static int GetCell(const Vector3& n)
+	{
+		const float ax = std::abs(n[0]), ay = std::abs(n[1]), az = std::abs(n[2]);
+		int face;
+		float major, u, v;
+		if(ax >= ay && ax >= az)
+		{
+			face = std::signbit(n[0]);
+			major = ax;
+			u = n[1];
+			v = n[2];
+		}
+		else if(ay >= az)
+		{
+			face = 2 + std::signbit(n[1]);
+			major = ay;
+			u = n[0];
+			v = n[2];
+		}
+		else
+		{
+			face = 4 + std::signbit(n[2]);
+			major = az;
+			u = n[0];
+			v = n[1];
+		}
+		const float half = 0.5f * kResolution;
+		const float scale = half / major;
+		const int cu = static_cast<int>(std::clamp(u * scale + half, 0.f, kResolution - 1.f));
+		const int cv = static_cast<int>(std::clamp(v * scale + half, 0.f, kResolution - 1.f));
+		return (((face << kShift) + cv) << kShift) + cu;
+	}
+
+#ifdef QUAKENORMAL_SSE2
+	/// GetCell() for four directions
+	static __m128i GetCells(__m128 x, __m128 y, __m128 z)
+	{
+		auto select = [](__m128 mask, __m128 a, __m128 b) {return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));};
+
+		const __m128 signMask = _mm_set1_ps(-0.f);
+		const __m128 ax = _mm_andnot_ps(signMask, x);
+		const __m128 ay = _mm_andnot_ps(signMask, y);
+		const __m128 az = _mm_andnot_ps(signMask, z);
+		const __m128 xMajor = _mm_and_ps(_mm_cmpge_ps(ax, ay), _mm_cmpge_ps(ax, az));
+		const __m128 yMajor = _mm_andnot_ps(xMajor, _mm_cmpge_ps(ay, az));
+		const __m128 zMajor = _mm_andnot_ps(_mm_or_ps(xMajor, yMajor), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+
+		const __m128 major = select(xMajor, ax, select(yMajor, ay, az));
+		const __m128 signedMajor = select(xMajor, x, select(yMajor, y, z));
+		const __m128 u = select(xMajor, y, x);
+		const __m128 v = select(zMajor, y, z);
+
+		const __m128 half = _mm_set1_ps(0.5f * kResolution);
+		const __m128 scale = _mm_div_ps(half, major);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 last = _mm_set1_ps(kResolution - 1.f);
+		const __m128i cu = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(u, scale), half), zero), last));
+		const __m128i cv = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(v, scale), half), zero), last));
+
+		const __m128i faceBase = _mm_or_si128(_mm_and_si128(_mm_castps_si128(yMajor), _mm_set1_epi32(2)),
+											  _mm_and_si128(_mm_castps_si128(zMajor), _mm_set1_epi32(4)));
+		const __m128i face = _mm_add_epi32(faceBase, _mm_srli_epi32(_mm_castps_si128(signedMajor), 31));
+		return _mm_add_epi32(_mm_slli_epi32(_mm_add_epi32(_mm_slli_epi32(face, kShift), cv), kShift), cu);
+	}
+#endif
+
+	/// Same result as FindClosestNormal() for any n that IsGridSafe(), if cell is its GetCell()
+	uint8_t FindClosest(const Vector3& n, int cell) const
+	{
+		uint8_t bestIndex = 0;
+		float bestDot = -1;
+
+		for (uint32_t i = mOffsets[cell]; i < mOffsets[cell + 1]; ++i)
+		{
+			const uint8_t index = mCandidates[i];
+			const float dot = n.DotProduct(normals[index]);
+			if (dot > bestDot)
+			{
+				bestDot = dot;
+				bestIndex = index;
+			}
+		}
+
+		return bestIndex;
+	}
+
+private:
+	/// Added to the angular radius of each cell, for directions rounded into a neighboring cell
+	static constexpr double kAngleMargin = 1e-4;
+
+	/// Allowed difference of dot products, far more than float rounding
+	static constexpr double kDotMargin = 1e-4;
+
+	static constexpr double kPi = 3.14159265358979323846;
+
+	/// Direction of a point on a face, with u and v in -1..1
+	static void FaceDirection(int face, double u, double v, double direction[3])
+	{
+		const double sign = face & 1 ? -1 : 1;
+		const int axis = face >> 1;
+		direction[axis] = sign;
+		direction[axis == 0 ? 1 : 0] = u;
+		direction[axis == 2 ? 1 : 2] = v;
+		const double length = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+		for(int i = 0; i < 3; ++i)
+			direction[i] /= length;
+	}
+
+	static double Angle(const double a[3], const double b[3])
+	{
+		return std::acos(std::clamp(a[0] * b[0] + a[1] * b[1] + a[2] * b[2], -1.0, 1.0));
+	}
+
+	NormalGrid()
+	{
+		const int numCells = 6 << (2 * kShift);
+		mOffsets.reserve(numCells + 1);
+		mOffsets.push_back(0);
+		std::vector<double> lengths, angles(normals.size());
+		for(const Vector3& normal: normals)
+			lengths.push_back(std::sqrt(double(normal[0]) * normal[0] + double(normal[1]) * normal[1] + double(normal[2]) * normal[2]));
+
+		for(int cell = 0; cell < numCells; ++cell)
+		{
+			const int face = cell >> (2 * kShift);
+			const int cv = (cell >> kShift) & (kResolution - 1);
+			const int cu = cell & (kResolution - 1);
+			const double step = 2.0 / kResolution;
+			const double u0 = -1 + cu * step;
+			const double v0 = -1 + cv * step;
+
+			// The cone from the center through the corners contains the whole cell:
+			double center[3];
+			FaceDirection(face, u0 + 0.5 * step, v0 + 0.5 * step, center);
+			double radius = 0;
+			for(int corner = 0; corner < 4; ++corner)
+			{
+				double direction[3];
+				FaceDirection(face, u0 + (corner & 1) * step, v0 + (corner >> 1) * step, direction);
+				radius = std::max(radius, Angle(center, direction));
+			}
+			radius += kAngleMargin;
+
+			// Within the cone, the dot product with each normal stays between these bounds:
+			double bestLowest = -2;
+			for(size_t i = 0; i < normals.size(); ++i)
+			{
+				const double normal[3] = {normals[i][0] / lengths[i], normals[i][1] / lengths[i], normals[i][2] / lengths[i]};
+				angles[i] = Angle(center, normal);
+				bestLowest = std::max(bestLowest, lengths[i] * std::cos(std::min(angles[i] + radius, kPi)));
+			}
+			for(size_t i = 0; i < normals.size(); ++i)
+			{
+				const double highest = lengths[i] * std::cos(std::max(angles[i] - radius, 0.0));
+				if(highest >= bestLowest - kDotMargin)
+					mCandidates.push_back(i);
+			}
+			mOffsets.push_back(mCandidates.size());
+		}
+	}
+
+	/// Candidates of cell i are mCandidates[mOffsets[i]] to mCandidates[mOffsets[i + 1] - 1]
+	std::vector<uint32_t> mOffsets;
+	std::vector<uint8_t> mCandidates;
+};
+
+uint8_t QuakeNormal(const Vector3& n)
+{
+	if(!IsGridSafe(n))
+		return FindClosestNormal(n);
+	return NormalGrid::Get().FindClosest(n, NormalGrid::GetCell(n));
+}
+
+void QuakeNormals(const Vector3* n, size_t count, uint8_t* indices)
+{
+	const NormalGrid& grid = NormalGrid::Get();
+	size_t i = 0;
+#ifdef QUAKENORMAL_SSE2
+	for(; i + 4 <= count; i += 4)
+	{
+		const __m128 x = _mm_setr_ps(n[i][0], n[i + 1][0], n[i + 2][0], n[i + 3][0]);
+		const __m128 y = _mm_setr_ps(n[i][1], n[i + 1][1], n[i + 2][1], n[i + 3][1]);
+		const __m128 z = _mm_setr_ps(n[i][2], n[i + 1][2], n[i + 2][2], n[i + 3][2]);
+		alignas(16) int32_t cells[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(cells), NormalGrid::GetCells(x, y, z));
+		for(int j = 0; j < 4; ++j)
+			indices[i + j] = IsGridSafe(n[i + j]) ? grid.FindClosest(n[i + j], cells[j]) : FindClosestNormal(n[i + j]);
+	}
+#endif
+	for(; i < count; ++i)
+		indices[i] = QuakeNormal(n[i]);
+}
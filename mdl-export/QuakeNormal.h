@@ -28,6 +28,16 @@ SOFTWARE.
 
 #include <molecular/util/Vector3.h>
 
+#include <cstddef>
+#include <cstdint>
+
+/// Index of the closest of the 162 Quake vertex normals
+/** Looks up the few candidates for the direction of n in a precomputed cube map, and compares only those. The
+	result is the same as comparing n with all normals: the largest dot product wins, and the lowest index wins ties. */
 uint8_t QuakeNormal(const molecular::util::Vector3& n);
 
+/// QuakeNormal() for many vectors, e.g. all normals of a frame
+/** Finds the cube map cells of four normals at a time with SSE2 where available. */
+void QuakeNormals(const molecular::util::Vector3* n, size_t count, uint8_t* indices);
+
 #endif // QUAKENORMAL_H
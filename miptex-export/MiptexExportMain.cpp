@@ -1,8 +1,11 @@
 #include "MiptexFile.h"
 
+#include <DepFile.h>
 #include <LoadPalette.h>
+#include <OutputFile.h>
 #include <PaletteImage.h>
 #include <QuakePalette.h>
+#include <QuantizationCache.h>
 #include <TextureImage.h>
 #include <Transparency.h>
 #include <WriteImage.h>
@@ -11,19 +14,45 @@
 #include <molecular/util/StringUtils.h>
 #include <molecular/util/CommandLineParser.h>
 
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 using namespace molecular;
 using namespace molecular::util;
 
+static std::vector<std::string> Split(const std::string& text, char separator)
+{
+	std::vector<std::string> parts;
+	size_t begin = 0;
+	for(size_t end = text.find(separator); end != std::string::npos; end = text.find(separator, begin))
+	{
+		parts.push_back(text.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	parts.push_back(text.substr(begin));
+	return parts;
+}
+
 int Main(int argc, char** argv)
 {
 	CommandLineParser cmd;
 	CommandLineParser::PositionalArg<std::string> inFileName(cmd, "input file", "Input image");
 	CommandLineParser::PositionalArg<std::string> outFileName(cmd, "output file", "Output MIPTEX file");
-	CommandLineParser::Flag dither(cmd, "dither", "Enable dithering");
+	CommandLineParser::Flag dither(cmd, "dither", "Enable Floyd-Steinberg dithering");
+	CommandLineParser::Option<std::string> ditherModeOption(cmd, "dither-mode", "Dithering mode: none, floyd-steinberg, atkinson, sierra, jarvis, bayer4, bayer8 or blue-noise. Overrides --dither.");
 	CommandLineParser::Option<std::string> palette(cmd, "palette", "Palette to use instead of default Quake palette. Can be image or lump.");
+	CommandLineParser::Option<std::string> metric(cmd, "metric", "Color distance for palette matching: rgb or oklab", "rgb");
 	CommandLineParser::Option<std::string> emission(cmd, "emission", "Emission texture to use for fullbright colors.");
 	CommandLineParser::Option<float> hdrScale(cmd, "hdr-scale", "Controls brightness when using HDR images.", 1.0f);
 	CommandLineParser::Option<std::string> previewOutput(cmd, "preview-output", "Write quantized image back to file");
+	CommandLineParser::Option<int> threads(cmd, "threads", "Number of threads, 0 uses all hardware threads. The output does not depend on this.", 0);
+	CommandLineParser::Flag streaming(cmd, "streaming", "Scale down, quantize and write one row at a time. Uses much less memory for very large images, but only one thread.");
+	CommandLineParser::Option<std::string> variantsOption(cmd, "variants", "More output files from the same image, separated by semicolons. Each is \"output file,palette,dither,MIP level\". Empty fields are taken from the main output, MIP level 1 is half size.");
+	CommandLineParser::Option<std::string> cacheDirectory(cmd, "cache", "Directory for quantized images. Unchanged inputs are taken from there without decoding.");
+	CommandLineParser::Option<std::string> depFile(cmd, "depfile", "Write the input files read as Makefile rule.");
+	CommandLineParser::Flag keepUnchanged(cmd, "keep-unchanged", "Don't touch output files if their contents would be the same.");
 	CommandLineParser::Option<std::string> nameOption(cmd, "name", "Name of the texture embedded in file. Defaults to file name without extension.");
 	CommandLineParser::HelpFlag help(cmd);
 
@@ -40,16 +69,34 @@ int Main(int argc, char** argv)
 
 	const uint8_t* paletteData = quakePalette;
 	std::vector<uint8_t> loadedPalette;
+	std::vector<std::string> inputFiles = {*inFileName};
 	if(palette)
 	{
 		loadedPalette = LoadPaletteFile(palette->c_str());
 		paletteData = loadedPalette.data();
+		inputFiles.push_back(*palette);
+	}
+
+	if(streaming && variantsOption)
+	{
+		std::cerr << "Variants can't be streamed" << std::endl;
+		return EXIT_FAILURE;
 	}
 
-	FileWriteStorage outFile(outFileName->c_str());
+	OutputFile output(*outFileName, static_cast<bool>(keepUnchanged));
+	auto outFile = std::make_unique<FileWriteStorage>(output.GetPath().c_str());
 	TextureImage textureImage(inFileName->c_str());
 	if(emission)
+	{
 		textureImage.SetEmission(emission->c_str());
+		inputFiles.push_back(*emission);
+	}
+	std::unique_ptr<QuantizationCache> cache;
+	if(cacheDirectory)
+	{
+		cache = std::make_unique<QuantizationCache>(*cacheDirectory);
+		textureImage.SetCache(cache.get());
+	}
 	const auto width = textureImage.GetWidth();
 	const auto height = textureImage.GetHeight();
 
@@ -59,22 +106,97 @@ int Main(int argc, char** argv)
 		return EXIT_FAILURE;
 	}
 
-	MiptexFile outMiptexFile(outFile);
+	const DitherMode ditherMode = ditherModeOption ? ParseDitherMode(*ditherModeOption) : dither ? DitherMode::FLOYD_STEINBERG : DitherMode::NONE;
+	const TexturePalette texturePalette(paletteData, ParseColorMetric(*metric));
+	MiptexFile outMiptexFile(*outFile);
 	const std::string name = nameOption ? *nameOption : StringUtils::FileNameWithoutExtension(*inFileName);
 	outMiptexFile.WriteHeader(name.c_str(), width, height);
 
-	for(int i = 0; i < 4; ++i)
+	std::vector<std::vector<uint8_t>> mips;
+	std::vector<std::string> variantFileNames;
+	if(streaming)
 	{
-		auto indexedImage = textureImage.ToIndexed(paletteData, dither, i, *hdrScale);
-		outMiptexFile.WriteMip(indexedImage.data(), indexedImage.size());
+		// Level 0 is written as it comes, the smaller levels follow once they are all done:
+		mips.resize(4);
+		textureImage.StreamIndexedMips(texturePalette, ditherMode, 4, *hdrScale, [&](int level, int, const uint8_t* indices)
+		{
+			if(level == 0)
+			{
+				outMiptexFile.WriteMip(indices, width);
+				if(!previewOutput)
+					return;
+			}
+			mips[level].insert(mips[level].end(), indices, indices + (width >> level));
+		});
+		for(int level = 1; level < 4; ++level)
+			outMiptexFile.WriteMip(mips[level].data(), mips[level].size());
+	}
+	else
+	{
+		// Variants are quantized together with the main output, from the same decoded image:
+		std::vector<TextureVariant> variants = {{&texturePalette, ditherMode, 0}};
+		std::vector<std::unique_ptr<TexturePalette>> variantPalettes;
+		for(const std::string& spec: variantsOption ? Split(*variantsOption, ';') : std::vector<std::string>())
+		{
+			const std::vector<std::string> fields = Split(spec, ',');
+			if(fields[0].empty() || fields.size() > 4)
+				throw std::runtime_error("Invalid variant \"" + spec + "\"");
+			TextureVariant variant = variants[0];
+			if(fields.size() > 1 && !fields[1].empty())
+			{
+				const std::vector<uint8_t> variantPalette = LoadPaletteFile(fields[1].c_str());
+				variantPalettes.push_back(std::make_unique<TexturePalette>(variantPalette.data(), ParseColorMetric(*metric)));
+				variant.palette = variantPalettes.back().get();
+				inputFiles.push_back(fields[1]);
+			}
+			if(fields.size() > 2 && !fields[2].empty())
+				variant.dither = ParseDitherMode(fields[2]);
+			if(fields.size() > 3 && !fields[3].empty())
+				variant.firstLevel = std::stoi(fields[3]);
+			if(variant.firstLevel < 0 || variant.firstLevel > 16 || width % (8 << variant.firstLevel) != 0 || height % (8 << variant.firstLevel) != 0)
+				throw std::runtime_error("Variant \"" + spec + "\" is not a multiple of 8 in size");
+			variants.push_back(variant);
+			variantFileNames.push_back(fields[0]);
+		}
+
+		auto results = textureImage.ToIndexedVariants(variants, 4, *hdrScale, *threads);
+		mips = std::move(results[0]);
+		for(const auto& indexedImage: mips)
+			outMiptexFile.WriteMip(indexedImage.data(), indexedImage.size());
 
-		if(i == 0 && previewOutput)
+		for(size_t i = 1; i < variants.size(); ++i)
 		{
-			auto previewImage = ConvertToRgb(indexedImage.data(), width, height, paletteData);
-			WriteRgbImage(previewOutput->c_str(), previewImage.data(), width, height);
+			OutputFile variantOutput(variantFileNames[i - 1], static_cast<bool>(keepUnchanged));
+			{
+				FileWriteStorage variantFile(variantOutput.GetPath().c_str());
+				MiptexFile variantMiptexFile(variantFile);
+				variantMiptexFile.WriteHeader(name.c_str(), width >> variants[i].firstLevel, height >> variants[i].firstLevel);
+				for(const auto& indexedImage: results[i])
+					variantMiptexFile.WriteMip(indexedImage.data(), indexedImage.size());
+			}
+			variantOutput.Commit();
 		}
 	}
 
+	// Closes the file before it is compared with the previous output:
+	outFile.reset();
+	output.Commit();
+
+	if(previewOutput)
+	{
+		auto previewImage = ConvertToRgb(mips[0].data(), width, height, paletteData);
+		WriteRgbImage(previewOutput->c_str(), previewImage.data(), width, height);
+	}
+
+	if(depFile)
+	{
+		std::vector<std::string> targets = {*outFileName};
+		targets.insert(targets.end(), variantFileNames.begin(), variantFileNames.end());
+		if(previewOutput)
+			targets.push_back(*previewOutput);
+		WriteDepFile(*depFile, targets, inputFiles);
+	}
+
 	return EXIT_SUCCESS;
 }
 
@@ -1,3 +1,6 @@
+#include <DepFile.h>
+#include <OutputFile.h>
+
 #include <molecular/util/FileStreamStorage.h>
 #include <molecular/util/StringUtils.h>
 #include <molecular/util/CommandLineParser.h>
@@ -27,6 +30,8 @@ int Main(int argc, char** argv)
 	CommandLineParser cmd;
 	CommandLineParser::Flag mergePaks(cmd, "merge-paks", "Input files are PAK files to be merged into one");
 	CommandLineParser::Option<std::string> prefix(cmd, "prefix", "Prefix to prepend to all file names inside the PAK file", "");
+	CommandLineParser::Option<std::string> depFile(cmd, "depfile", "Write the input files read as Makefile rule");
+	CommandLineParser::Flag keepUnchanged(cmd, "keep-unchanged", "Don't touch the output file if its contents would be the same");
 	CommandLineParser::PositionalArg<std::string> outFileName(cmd, "output file", "Output PAK file");
 	CommandLineParser::RemainingPositionalArgs remaining(cmd, "input files", "Input files");
 	CommandLineParser::HelpFlag help(cmd);
@@ -42,70 +47,77 @@ int Main(int argc, char** argv)
 		return EXIT_FAILURE;
 	}
 
-	FileWriteStorage outFile(outFileName->c_str());
+	OutputFile output(*outFileName, static_cast<bool>(keepUnchanged));
+	{
+		FileWriteStorage outFile(output.GetPath().c_str());
 
-	PakHeader header;
-	outFile.Write(&header, sizeof(PakHeader));
-	std::vector<PakEntry> entries;
+		PakHeader header;
+		outFile.Write(&header, sizeof(PakHeader));
+		std::vector<PakEntry> entries;
 
-	for(auto& fileName: *remaining)
-	{
-		if(mergePaks)
+		for(auto& fileName: *remaining)
 		{
-			FileReadStorage inputPakFile(fileName);
-			PakHeader inHeader;
-			inputPakFile.Read(&inHeader, sizeof(PakHeader));
-			if(strncmp(inHeader.magic, "PACK", 4) != 0)
-				throw std::runtime_error("Not a PAK file");
-
-			const size_t inputPakSize = inputPakFile.GetSize();
-			// Check if PAK directory is inside file:
-			if(inHeader.diroffset + inHeader.dirsize > inputPakSize)
-				throw std::runtime_error("PAK file is corrupt");
-
-			std::vector<PakEntry> inEntries(inHeader.dirsize / 64);
-			inputPakFile.SetCursor(inHeader.diroffset);
-			inputPakFile.Read(inEntries.data(), inHeader.dirsize);
-			for(auto& inEntry: inEntries)
+			if(mergePaks)
 			{
-				if(inEntry.offset + inEntry.size > inputPakSize)
+				FileReadStorage inputPakFile(fileName);
+				PakHeader inHeader;
+				inputPakFile.Read(&inHeader, sizeof(PakHeader));
+				if(strncmp(inHeader.magic, "PACK", 4) != 0)
+					throw std::runtime_error("Not a PAK file");
+
+				const size_t inputPakSize = inputPakFile.GetSize();
+				// Check if PAK directory is inside file:
+				if(inHeader.diroffset + inHeader.dirsize > inputPakSize)
 					throw std::runtime_error("PAK file is corrupt");
 
-				inputPakFile.SetCursor(inEntry.offset);
-				std::vector<uint8_t> fileData(inEntry.size);
-				inputPakFile.Read(fileData.data(), inEntry.size);
+				std::vector<PakEntry> inEntries(inHeader.dirsize / 64);
+				inputPakFile.SetCursor(inHeader.diroffset);
+				inputPakFile.Read(inEntries.data(), inHeader.dirsize);
+				for(auto& inEntry: inEntries)
+				{
+					if(inEntry.offset + inEntry.size > inputPakSize)
+						throw std::runtime_error("PAK file is corrupt");
+
+					inputPakFile.SetCursor(inEntry.offset);
+					std::vector<uint8_t> fileData(inEntry.size);
+					inputPakFile.Read(fileData.data(), inEntry.size);
+					PakEntry entry;
+					memset(entry.filename, 0, 56);
+					snprintf(entry.filename, 56, "%s%s", prefix->c_str(), inEntry.filename);
+					entry.size = inEntry.size;
+					entry.offset = outFile.GetCursor();
+					entries.push_back(entry);
+					outFile.Write(fileData.data(), fileData.size());
+				}
+			}
+			else
+			{
+				FileReadStorage file(fileName);
+				size_t size = file.GetSize();
+				std::vector<uint8_t> fileData(size);
+				file.Read(fileData.data(), size);
+
 				PakEntry entry;
 				memset(entry.filename, 0, 56);
-				snprintf(entry.filename, 56, "%s%s", prefix->c_str(), inEntry.filename);
-				entry.size = inEntry.size;
+				snprintf(entry.filename, 56, "%s%s", prefix->c_str(), fileName.c_str());
+				entry.size = size;
 				entry.offset = outFile.GetCursor();
 				entries.push_back(entry);
 				outFile.Write(fileData.data(), fileData.size());
 			}
 		}
-		else
-		{
-			FileReadStorage file(fileName);
-			size_t size = file.GetSize();
-			std::vector<uint8_t> fileData(size);
-			file.Read(fileData.data(), size);
-
-			PakEntry entry;
-			memset(entry.filename, 0, 56);
-			snprintf(entry.filename, 56, "%s%s", prefix->c_str(), fileName.c_str());
-			entry.size = size;
-			entry.offset = outFile.GetCursor();
-			entries.push_back(entry);
-			outFile.Write(fileData.data(), fileData.size());
-		}
-	}
 
-	header.diroffset = outFile.GetCursor();
-	header.dirsize = entries.size() * sizeof(PakEntry);
+		header.diroffset = outFile.GetCursor();
+		header.dirsize = entries.size() * sizeof(PakEntry);
+
+		outFile.Write(entries.data(), entries.size() * sizeof(PakEntry));
+		outFile.SetCursor(0);
+		outFile.Write(&header, sizeof(PakHeader));
+	}
+	output.Commit();
 
-	outFile.Write(entries.data(), entries.size() * sizeof(PakEntry));
-	outFile.SetCursor(0);
-	outFile.Write(&header, sizeof(PakHeader));
+	if(depFile)
+		WriteDepFile(*depFile, {*outFileName}, std::vector<std::string>(remaining->begin(), remaining->end()));
 
 	return EXIT_SUCCESS;
 }
@@ -1,13 +1,20 @@
+#include <IndexedImage.h>
 #include <LoadPalette.h>
+#include <MappedFile.h>
 #include <PaletteImage.h>
+#include <PaletteLookup.h>
 #include <QuakePalette.h>
+#include <QuantizationCache.h>
+#include <ScanlineQuantizer.h>
+#include <Sha256.h>
 #include <StbImage.h>
-#include <Transparency.h>
 
 #include <molecular/util/CommandLineParser.h>
 #include <molecular/util/FileStreamStorage.h>
 
+#include <cstring>
 #include <iostream>
+#include <memory>
 
 using namespace molecular;
 using namespace molecular::util;
@@ -17,8 +24,12 @@ int Main(int argc, char** argv)
 	CommandLineParser cmd;
 	CommandLineParser::PositionalArg<std::string> inFileName(cmd, "input file", "Input image");
 	CommandLineParser::PositionalArg<std::string> outFileName(cmd, "output file", "Output .lmp file");
-	CommandLineParser::Flag dither(cmd, "dither", "Enable dithering");
+	CommandLineParser::Flag dither(cmd, "dither", "Enable Floyd-Steinberg dithering");
+	CommandLineParser::Option<std::string> ditherModeOption(cmd, "dither-mode", "Dithering mode: none, floyd-steinberg, atkinson, sierra, jarvis, bayer4, bayer8 or blue-noise. Overrides --dither.");
 	CommandLineParser::Option<std::string> palette(cmd, "palette", "Palette to use instead of default Quake palette. Can be image or lump.");
+	CommandLineParser::Option<std::string> metric(cmd, "metric", "Color distance for palette matching: rgb or oklab", "rgb");
+	CommandLineParser::Flag streaming(cmd, "streaming", "Quantize and write one row at a time. Uses much less memory for very large images.");
+	CommandLineParser::Option<std::string> cacheDirectory(cmd, "cache", "Directory for quantized images. Unchanged inputs are copied from there without decoding.");
 	CommandLineParser::HelpFlag help(cmd);
 
 	cmd.Parse(argc, argv);
@@ -31,19 +42,104 @@ int Main(int argc, char** argv)
 		paletteData = loadedPalette.data();
 	}
 
-	StbImage textureImage(inFileName->c_str(), 4);
-	const int32_t width = textureImage.GetWidth();
-	const int32_t height = textureImage.GetHeight();
+	const DitherMode ditherMode = ditherModeOption ? ParseDitherMode(*ditherModeOption) : dither ? DitherMode::FLOYD_STEINBERG : DitherMode::NONE;
+	const ColorMetric colorMetric = ParseColorMetric(*metric);
 
-	auto [color, alpha] = SplitColorAndAlpha(textureImage.Data(), width, height);
-	std::vector<uint8_t> indexedImage = ConvertToIndexed(color.data(), width, height, paletteData, dither);
-	SetTransparency(indexedImage, alpha);
+	const MappedFile inFile(inFileName->c_str());
+
+	// The cache entry is the whole output file, keyed by the input file, the palette and all options:
+	std::unique_ptr<QuantizationCache> cache;
+	std::string cacheKey;
+	if(cacheDirectory)
+	{
+		cache = std::make_unique<QuantizationCache>(*cacheDirectory);
+		Sha256 hash;
+		hash.Update("picture", 7);
+		hash.UpdateValue(QuantizationCache::kVersion);
+		hash.UpdateValue(static_cast<uint64_t>(inFile.GetSize()));
+		hash.Update(inFile.GetData(), inFile.GetSize());
+		hash.Update(paletteData, 256 * 3);
+		hash.UpdateValue(static_cast<int32_t>(colorMetric));
+		hash.UpdateValue(static_cast<int32_t>(ditherMode));
+		cacheKey = hash.HexDigest();
+
+		std::vector<std::vector<uint8_t>> cached;
+		if(cache->Load(cacheKey, cached) && cached.size() == 1)
+		{
+			FileWriteStorage outFile(outFileName->c_str());
+			outFile.Write(cached[0].data(), cached[0].size());
+			return EXIT_SUCCESS;
+		}
+	}
+
+	std::unique_ptr<StbImage> textureImage;
+	auto palettedImage = IndexedImage::TryLoad(inFile.GetData(), inFile.GetSize());
+	if(!palettedImage)
+		textureImage = std::make_unique<StbImage>(inFile.GetData(), inFile.GetSize(), 4);
+	int32_t width = palettedImage ? palettedImage->GetWidth() : textureImage->GetWidth();
+	int32_t height = palettedImage ? palettedImage->GetHeight() : textureImage->GetHeight();
+
+	// Images that only use palette colors are mapped directly, without any search:
+	std::vector<uint8_t> indexedImage;
+	if(palettedImage && KeepsExactColors(ditherMode))
+		indexedImage = palettedImage->Remap(paletteData);
+
+	// Header of the cache entry, the indices follow once they are done:
+	std::vector<uint8_t> lump;
+	if(cache)
+	{
+		lump.resize(8);
+		std::memcpy(lump.data(), &width, 4);
+		std::memcpy(lump.data() + 4, &height, 4);
+	}
 
 	FileWriteStorage outFile(outFileName->c_str());
 	outFile.Write(&width, 4);
 	outFile.Write(&height, 4);
+	if(streaming && indexedImage.empty())
+	{
+		// Rows are written as soon as they are quantized. Paletted images are expanded one row at a time. With a
+		// cache, the rows are also collected for it, which takes a quarter of the memory of the decoded image.
+		const PaletteLookup lookup(paletteData, 224, colorMetric); // Don't use fire and full-bright colors
+		ConversionOptions options;
+		options.dither = ditherMode;
+		ScanlineQuantizer quantizer(lookup, width, height, 4, options, [&](int, uint8_t* indices)
+		{
+			outFile.Write(indices, width);
+			if(cache)
+				lump.insert(lump.end(), indices, indices + width);
+		});
+		std::vector<uint8_t> expandedRow(palettedImage ? width * 4 : 0);
+		for(int y = 0; y < height; ++y)
+		{
+			if(palettedImage)
+			{
+				palettedImage->ExpandRow(y, expandedRow.data());
+				quantizer.PushRow(expandedRow.data());
+			}
+			else
+				quantizer.PushRow(textureImage->Data() + static_cast<size_t>(y) * width * 4);
+		}
+		if(cache)
+			cache->Store(cacheKey, {lump});
+		return EXIT_SUCCESS;
+	}
+
+	if(indexedImage.empty())
+	{
+		std::vector<uint8_t> expanded;
+		if(palettedImage)
+			expanded = palettedImage->ToRgba();
+		indexedImage = ConvertRgbaToIndexed(palettedImage ? expanded.data() : textureImage->Data(), width, height, paletteData, ditherMode, colorMetric);
+	}
 	outFile.Write(indexedImage.data(), indexedImage.size());
 
+	if(cache)
+	{
+		lump.insert(lump.end(), indexedImage.begin(), indexedImage.end());
+		cache->Store(cacheKey, {lump});
+	}
+
 	return EXIT_SUCCESS;
 }
 